@@ -5,6 +5,45 @@
 #include <malloc.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+
+// NOTE(Hakan): windows.h can't be included here, winnt.h declares an
+// enumerator named TokenType that hides our TokenType. Only the functions
+// mapProgramImageFile() needs are declared, as they are in the Win32 headers.
+typedef void *Win32Handle;
+#define WIN32_INVALID_HANDLE_VALUE ((Win32Handle)(intptr_t)-1)
+#define WIN32_GENERIC_READ 0x80000000ul
+#define WIN32_FILE_SHARE_READ 0x00000001ul
+#define WIN32_OPEN_EXISTING 3ul
+#define WIN32_FILE_ATTRIBUTE_NORMAL 0x00000080ul
+#define WIN32_PAGE_READONLY 0x02ul
+#define WIN32_FILE_MAP_READ 0x0004ul
+
+extern "C" {
+  __declspec(dllimport) Win32Handle __stdcall CreateFileA(const char *fileName, unsigned long desiredAccess,
+                                                          unsigned long shareMode, void *securityAttributes,
+                                                          unsigned long creationDisposition,
+                                                          unsigned long flagsAndAttributes, Win32Handle templateFile);
+  __declspec(dllimport) int __stdcall GetFileSizeEx(Win32Handle file, long long *fileSize);
+  __declspec(dllimport) Win32Handle __stdcall CreateFileMappingA(Win32Handle file, void *mappingAttributes,
+                                                                 unsigned long protect, unsigned long maximumSizeHigh,
+                                                                 unsigned long maximumSizeLow, const char *name);
+  __declspec(dllimport) void *__stdcall MapViewOfFile(Win32Handle mapping, unsigned long desiredAccess,
+                                                      unsigned long fileOffsetHigh, unsigned long fileOffsetLow,
+                                                      size_t numberOfBytesToMap);
+  __declspec(dllimport) int __stdcall UnmapViewOfFile(const void *baseAddress);
+  __declspec(dllimport) int __stdcall CloseHandle(Win32Handle object);
+}
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #define PI 3.141592653589
 #define ArrayCount(array) (sizeof((array))/sizeof((array)[0]))
@@ -16,25 +55,42 @@
 #endif
 
 typedef int8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef float r32;
 typedef double r64;
 typedef uint32_t bool32;
 
 #include "profiling.h"
+#include "number.h"
+
+// NOTE(Hakan): Operators written like function calls, their arguments are
+// counted at the closing parenthesis
+#define CALL_PRECEDENCE 8
 
-// NOTE(Hakan): OperatorType, precedence, isRightAssociative
+// NOTE(Hakan): OperatorType, precedence, isRightAssociative, argumentCount
 #define LIST_OPERATORS                          \
-  HANDLE_OPERATOR(Add, 2, 0)                    \
-  HANDLE_OPERATOR(Sub, 2, 0)                    \
-  HANDLE_OPERATOR(Mul, 3, 0)                    \
-  HANDLE_OPERATOR(Div, 3, 0)                    \
-  HANDLE_OPERATOR(Pow, 4, 1)                    \
-  HANDLE_OPERATOR(Sin, 5, 0)                    \
-  HANDLE_OPERATOR(Cos, 5, 0)                    \
-  HANDLE_OPERATOR(Tan, 5, 0)                    \
-  HANDLE_OPERATOR(Max, 5, 0)                    \
-  HANDLE_OPERATOR(Min, 5, 0)
-
-#define HANDLE_OPERATOR(type, precedence, associativity) Token_Op ## type,
+  HANDLE_OPERATOR(Or, 1, 0, 2)                  \
+  HANDLE_OPERATOR(And, 2, 0, 2)                 \
+  HANDLE_OPERATOR(Equal, 3, 0, 2)               \
+  HANDLE_OPERATOR(NotEqual, 3, 0, 2)            \
+  HANDLE_OPERATOR(Less, 4, 0, 2)                \
+  HANDLE_OPERATOR(LessEqual, 4, 0, 2)           \
+  HANDLE_OPERATOR(Greater, 4, 0, 2)             \
+  HANDLE_OPERATOR(GreaterEqual, 4, 0, 2)        \
+  HANDLE_OPERATOR(Add, 5, 0, 2)                 \
+  HANDLE_OPERATOR(Sub, 5, 0, 2)                 \
+  HANDLE_OPERATOR(Mul, 6, 0, 2)                 \
+  HANDLE_OPERATOR(Div, 6, 0, 2)                 \
+  HANDLE_OPERATOR(Pow, 7, 1, 2)                 \
+  HANDLE_OPERATOR(Sin, CALL_PRECEDENCE, 0, 1)   \
+  HANDLE_OPERATOR(Cos, CALL_PRECEDENCE, 0, 1)   \
+  HANDLE_OPERATOR(Tan, CALL_PRECEDENCE, 0, 1)   \
+  HANDLE_OPERATOR(Max, CALL_PRECEDENCE, 0, 2)   \
+  HANDLE_OPERATOR(Min, CALL_PRECEDENCE, 0, 2)   \
+  HANDLE_OPERATOR(If, CALL_PRECEDENCE, 0, 3)
+
+#define HANDLE_OPERATOR(type, precedence, associativity, argumentCount) Token_Op ## type,
 
 enum TokenType {
   Token_Unknown,
@@ -47,41 +103,170 @@ enum TokenType {
   Token_CloseParen,
   Token_Comma,
 
+  // NOTE(Hakan): Never produced by getToken(), cStringToRTN() emits these at
+  // the commas of if(cond, a, b) so the RTN reads
+  // cond IfThen a IfElse b OpIf and a branch can be skipped as a whole
+  Token_IfThen,
+  Token_IfElse,
+
   Token_Number,
   Token_Identifier,
 
+  // NOTE(Hakan): A call to a function from the FunctionTable and, inside the
+  // body of an expression function, a reference to one of its parameters
+  Token_Function,
+  Token_Argument,
+  Token_Assign,
+
+  // NOTE(Hakan): Never produced by getToken(), an inlined call stores each of
+  // its arguments in a local slot once and every use of the parameter loads it
+  Token_StoreLocal,
+  Token_LoadLocal,
+
   Token_EndOfStream,
   Tokens_Count,
 };
 #undef HANDLE_OPERATOR
 
 struct Token {
-  union {
-    r64 number;
-    struct {
-      size_t textLength;
-      char *text;
-    };
-  };
+  size_t textLength;
+  char *text;
   TokenType type;
+  // NOTE(Hakan): Token_Function: index into the FunctionTable,
+  // Token_Argument: index of the parameter,
+  // Token_StoreLocal and Token_LoadLocal: the local slot
+  size_t index;
+};
+
+struct FunctionTable;
+
+struct ListOfTokens {
+  Token *tokens;
+  size_t count;
+  size_t capacity;
+
+  FunctionTable *functions;
+};
+
+// NOTE(Hakan): Makes room for at least count items, the capacity doubles so
+// pushing one item at a time stays linear
+template <typename Type>
+static inline void growArray(Type **items, size_t *capacity, size_t count) {
+  if (count > *capacity) {
+    size_t newCapacity = (*capacity == 0) ? 16 : 2 * *capacity;
+    while (newCapacity < count) {
+      newCapacity *= 2;
+    }
+
+    *items = (Type*)realloc(*items, sizeof(Type) * newCapacity);
+    *capacity = newCapacity;
+  }
+}
+
+static void pushToken(ListOfTokens *list, Token token) {
+  growArray(&list->tokens, &list->capacity, list->count + 1);
+  list->tokens[list->count] = token;
+  list->count++;
+}
+
+// NOTE(Hakan): Functions defined by the caller. Expression functions keep the
+// RTN of their body, which parseExpression() splices in place of every call so
+// compileProgram() sees one flat program. The arguments are not copied into the
+// body, each one is evaluated once into a local slot. Native functions are called with
+// whole columns of arguments, once per block of rows in evalProgramBatch().
+#define FUNCTION_MAX_ARGUMENTS 16
+
+template <typename Number>
+using NativeFunction = void (*)(Number **arguments, Number *results, size_t rowCount, void *userData);
+
+struct Function {
+  char *name;
+  size_t nameLength;
+  size_t argumentCount;
+
+  // NOTE(Hakan): Expression functions, the body tokens point into definition
+  char *definition;
+  ListOfTokens body;
+
+  // NOTE(Hakan): Native functions
+  void *callback;
+  void *userData;
+  NumberType numberType;
+};
+
+struct FunctionTable {
+  Function *functions;
+  size_t count;
+  size_t capacity;
 };
 
+// NOTE(Hakan): Fills buffer with up to size bytes of the expression and
+// returns how many were read, 0 once the input is exhausted and
+// READ_INPUT_FAILED if it can't be read
+typedef size_t ReadInput(void *source, char *buffer, size_t size);
+#define READ_INPUT_FAILED ((size_t)-1)
+
+// NOTE(Hakan): Streamed input is read into a block of TOKENIZER_BLOCK_SIZE
+// bytes. A refill moves the bytes that were left to the start of the block,
+// and getToken() refills whenever fewer than TOKEN_MAX_LENGTH bytes are left,
+// so a token never straddles two refills. Longer tokens are cut in two.
+#define TOKENIZER_BLOCK_SIZE (64*1024)
+#define TOKEN_MAX_LENGTH 256
+
+#define ERROR_MESSAGE_SIZE 256
+
 struct Tokenizer {
   char *at;
   Token previousToken;
+  FunctionTable *functions;
+
+  // NOTE(Hakan): Streaming, read is null when at is a whole null-terminated
+  // string. The text of tokens is only valid until the next refill.
+  ReadInput *read;
+  void *source;
+  char *end;
+  char *block;
+  bool32 isInputExhausted;
+  bool32 isInputFailed;
+
+  // NOTE(Hakan): Why parsing or compiling the expression failed
+  char error[ERROR_MESSAGE_SIZE];
 };
 
 struct Operator {
+  const char *name;
   size_t precedence;
   bool32 isRightAssociative;
+  size_t argumentCount;
 };
 
-#define HANDLE_OPERATOR(type, precedence, associativity) {precedence, associativity},
+#define HANDLE_OPERATOR(type, precedence, associativity, argumentCount) {#type, precedence, associativity, argumentCount},
 static const Operator operatorLookup[] = {
   LIST_OPERATORS
 };
 #undef HANDLE_OPERATOR
 
+static inline const Operator *getOperator(u32 type) {
+  ASSERT((type > Token_OpStart) && (type < Token_OpEnd));
+  return &operatorLookup[type - Token_OpStart - 1];
+}
+
+static inline bool32 isCall(u32 type) {
+  return (bool32)((type == Token_Function) ||
+                  ((type > Token_OpStart) && (type < Token_OpEnd) &&
+                   (getOperator(type)->precedence == CALL_PRECEDENCE)));
+}
+
+static inline bool32 isBinaryOperator(u32 type) {
+  return (bool32)((type > Token_OpStart) && (type < Token_OpEnd) && !isCall(type));
+}
+
+// NOTE(Hakan): Tokens a value can end with, a binary operator has to follow
+// one of these and nothing that starts a value may
+static inline bool32 isOperandEnd(u32 type) {
+  return (bool32)((type == Token_Number) || (type == Token_Identifier) || (type == Token_CloseParen));
+}
+
 
 inline bool32 isEndOfLine(char c) {
   return (bool32) (c == '\n' || c == '\r');
@@ -100,9 +285,74 @@ inline bool32 isDigit(char c) {
   return (bool32) (c >= '0' && c <= '9');
 }
 
+static void refillTokenizer(Tokenizer *tokenizer) {
+  size_t leftCount = tokenizer->end - tokenizer->at;
+  ASSERT(leftCount < TOKENIZER_BLOCK_SIZE);
+
+  if (!tokenizer->block) {
+    tokenizer->block = (char*)malloc(TOKENIZER_BLOCK_SIZE + 1);
+  }
+
+  char *text = tokenizer->block;
+  if (leftCount > 0) {
+    memmove(text, tokenizer->at, leftCount);
+  }
+  tokenizer->at = text;
+  tokenizer->end = text + leftCount;
+
+  while (!tokenizer->isInputExhausted && (tokenizer->end < text + TOKENIZER_BLOCK_SIZE)) {
+    size_t readCount = tokenizer->read(tokenizer->source, tokenizer->end, text + TOKENIZER_BLOCK_SIZE - tokenizer->end);
+    if (readCount == READ_INPUT_FAILED) {
+      tokenizer->isInputFailed = 1;
+      readCount = 0;
+    }
+    tokenizer->isInputExhausted = (bool32)(readCount == 0);
+    tokenizer->end += readCount;
+  }
+  tokenizer->end[0] = '\0';
+}
+
+void beginTokenizerStream(Tokenizer *tokenizer, ReadInput *read, void *source) {
+  tokenizer->read = read;
+  tokenizer->source = source;
+  refillTokenizer(tokenizer);
+}
+
+void endTokenizerStream(Tokenizer *tokenizer) {
+  free(tokenizer->block);
+  tokenizer->block = 0;
+  tokenizer->at = tokenizer->end = 0;
+}
+
+// NOTE(Hakan): ReadInput for a file descriptor, source points to the int
+size_t readFileDescriptor(void *source, char *buffer, size_t size) {
+  int file = *(int*)source;
+  for (;;) {
+#ifdef _WIN32
+    int readCount = _read(file, buffer, (unsigned int)size);
+#else
+    ssize_t readCount = read(file, buffer, size);
+#endif
+    if (readCount >= 0) {
+      return (size_t)readCount;
+    }
+    else if (errno != EINTR) {
+      return READ_INPUT_FAILED;
+    }
+  }
+}
+
 static void eatAllWhitespace(Tokenizer *tokenizer) {
-  while (isWhitespace(tokenizer->at[0])) {
-    ++tokenizer->at;
+  for (;;) {
+    while (isWhitespace(tokenizer->at[0])) {
+      ++tokenizer->at;
+    }
+
+    if (!tokenizer->read || tokenizer->isInputExhausted ||
+        (tokenizer->end - tokenizer->at >= TOKEN_MAX_LENGTH)) {
+      break;
+    }
+    refillTokenizer(tokenizer);
   }
 }
 
@@ -121,18 +371,16 @@ static bool32 tokenEquals(Token token, const char *text) {
   return (bool32) (*at == '\0');
 }
 
-static inline r64 numberTokenToValue(Token *token) {
+// NOTE(Hakan): Number tokens keep their text so the same token can be
+// converted to whatever numeric type the program is compiled for
+template <typename Number>
+static inline Number numberTokenToValue(Token *token) {
   ASSERT(token->type == Token_Number);
 
-  constexpr unsigned long long pow10[] = {
-    1, 10, 100,
-    1000, 10000, 100000,
-    1000000, 10000000, 100000000,
-    1000000000, 10000000000, 100000000000,
-    1000000000000, 10000000000000, 100000000000000,
-    1000000000000000, 10000000000000000, 100000000000000000,
-    1000000000000000000, 10000000000000000000UL,
-  };
+  if (isAlpha(token->text[0])) {
+    ASSERT(tokenEquals(*token, "pi"));
+    return numberPi<Number>();
+  }
 
   bool32 isNegative = 0;
   unsigned long long mantisa = 0;
@@ -141,14 +389,11 @@ static inline r64 numberTokenToValue(Token *token) {
   for (size_t textIndex = 0; textIndex < token->textLength; textIndex++) {
     char c = token->text[textIndex];
     if(isDigit(c)){
-      size_t exp = token->textLength - textIndex - 1;
-      ASSERT(exp <= ArrayCount(pow10));
-      mantisa += (c - '0') * pow10[exp];
+      mantisa = 10 * mantisa + (c - '0');
     }
     else if (c == '.') {
       numDigitsAfterDecimalPoint = token->textLength - textIndex - 1;
-      ASSERT(numDigitsAfterDecimalPoint <= ArrayCount(pow10));
-      mantisa /= 10;
+      ASSERT(numDigitsAfterDecimalPoint < ArrayCount(powersOf10));
     }
     else if(c == '-') {
       isNegative = true;
@@ -162,7 +407,7 @@ static inline r64 numberTokenToValue(Token *token) {
     }
   }
 
-  r64 result = (r64)mantisa / (r64)pow10[numDigitsAfterDecimalPoint];
+  Number result = numberFromDecimal<Number>(mantisa, numDigitsAfterDecimalPoint);
   if (isNegative) {
     result = -result;
   }
@@ -170,6 +415,24 @@ static inline r64 numberTokenToValue(Token *token) {
   return result;
 }
 
+// NOTE(Hakan): Later definitions shadow earlier ones with the same name
+static bool32 findFunction(FunctionTable *table, Token token, size_t *functionIndex) {
+  if (!table) {
+    return 0;
+  }
+
+  for (size_t index = table->count; index > 0; index--) {
+    Function *function = &table->functions[index - 1];
+    if ((function->nameLength == token.textLength) &&
+        (strncmp(function->name, token.text, token.textLength) == 0)) {
+      *functionIndex = index - 1;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
 static Token getToken(Tokenizer *tokenizer) {
   Token result = {};
 
@@ -194,7 +457,8 @@ static Token getToken(Tokenizer *tokenizer) {
       }
       else if (((tokenizer->previousToken.type < Token_OpEnd) && (tokenizer->previousToken.type > Token_OpStart)) ||
                (tokenizer->previousToken.type == Token_OpenParen) ||
-               (tokenizer->previousToken.type == Token_Comma)) {
+               (tokenizer->previousToken.type == Token_Comma) ||
+               (tokenizer->previousToken.type == Token_Assign)) {
         goto UnarySign;
       }
       else {
@@ -202,6 +466,51 @@ static Token getToken(Tokenizer *tokenizer) {
       }
     } break;
     case '*': {result.type = Token_OpMul;} break;
+    case '<': {
+      if (tokenizer->at[0] == '=') {
+        ++tokenizer->at;
+        result.type = Token_OpLessEqual;
+      }
+      else {
+        result.type = Token_OpLess;
+      }
+    } break;
+    case '>': {
+      if (tokenizer->at[0] == '=') {
+        ++tokenizer->at;
+        result.type = Token_OpGreaterEqual;
+      }
+      else {
+        result.type = Token_OpGreater;
+      }
+    } break;
+    case '=': {
+      if (tokenizer->at[0] == '=') {
+        ++tokenizer->at;
+        result.type = Token_OpEqual;
+      }
+      else {
+        result.type = Token_Assign;
+      }
+    } break;
+    case '!': {
+      if (tokenizer->at[0] == '=') {
+        ++tokenizer->at;
+        result.type = Token_OpNotEqual;
+      }
+    } break;
+    case '&': {
+      if (tokenizer->at[0] == '&') {
+        ++tokenizer->at;
+        result.type = Token_OpAnd;
+      }
+    } break;
+    case '|': {
+      if (tokenizer->at[0] == '|') {
+        ++tokenizer->at;
+        result.type = Token_OpOr;
+      }
+    } break;
     case '/': {result.type = Token_OpDiv;} break;
     case '^': {result.type = Token_OpPow;} break;
 
@@ -219,7 +528,7 @@ static Token getToken(Tokenizer *tokenizer) {
         result.textLength = (uint32_t)(tokenizer->at - result.text);
 
         if (tokenEquals(result, "pi")) {
-          result.number = PI;
+          result.type = Token_Number;
         }
         else if (tokenEquals(result, "sin")) {
           result.type = Token_OpSin;
@@ -236,6 +545,12 @@ static Token getToken(Tokenizer *tokenizer) {
         else if (tokenEquals(result, "min")) {
           result.type = Token_OpMin;
         }
+        else if (tokenEquals(result, "if")) {
+          result.type = Token_OpIf;
+        }
+        else if (findFunction(tokenizer->functions, result, &result.index)) {
+          result.type = Token_Function;
+        }
         else {
           break;
         }
@@ -250,7 +565,6 @@ UnarySign:
         }
 
         result.textLength = tokenizer->at - result.text;
-        result.number = numberTokenToValue(&result);
       }
       else {
         result.type = Token_Unknown;
@@ -262,71 +576,232 @@ UnarySign:
   return result;
 }
 
-struct ListOfTokens {
-  Token *tokens;
-  size_t count;
-};
-
-ListOfTokens cStringToRTN(Tokenizer *tokenizer) {
-  // NOTE(Hakan): The number of tokens can never exceed the length of the math
-  // expression string
-  // const size_t tokensMaxCount = strlen(tokenizer->at);
-  const size_t tokensMaxCount = strlen(tokenizer->at);
+// NOTE(Hakan): The arguments of the call have already been emitted and are on
+// the stack, the last one on top. They are popped into local slots 0 to
+// argumentCount - 1 by a StoreLocal each, then the body follows with a
+// LoadLocal in place of every Token_Argument. The slots of the calls inside the
+// body come after the arguments, so they never overwrite an argument that is
+// still used, and calls inside the arguments are done with their slots before
+// the arguments are stored.
+static void inlineFunctionCall(ListOfTokens *output, Function *function) {
+  Token local = {};
+  local.text = function->name;
+  local.textLength = function->nameLength;
+
+  for (size_t argumentIndex = function->argumentCount; argumentIndex > 0; argumentIndex--) {
+    local.type = Token_StoreLocal;
+    local.index = argumentIndex - 1;
+    pushToken(output, local);
+  }
 
-  ListOfTokens result = {};
-  result.tokens = (Token*)malloc(sizeof(Token) * tokensMaxCount);
+  for (size_t tokenIndex = 0; tokenIndex < function->body.count; tokenIndex++) {
+    Token token = function->body.tokens[tokenIndex];
+    if (token.type == Token_Argument) {
+      local.type = Token_LoadLocal;
+      local.index = token.index;
+      pushToken(output, local);
+    }
+    else if ((token.type == Token_StoreLocal) || (token.type == Token_LoadLocal)) {
+      token.index += function->argumentCount;
+      pushToken(output, token);
+    }
+    else {
+      pushToken(output, token);
+    }
+  }
+}
 
-  Token *operatorStack = (Token*)alloca(sizeof(Token) * tokensMaxCount);
+// NOTE(Hakan): Receives the RTN one token at a time, in order, and returns 0
+// to stop parsing after it has written why to its error message
+typedef bool32 EmitToken(void *context, Token *token);
+
+// NOTE(Hakan): Shunting-yard over a tokenizer that may be streaming. The
+// operator stack only holds what is still open, so memory grows with the
+// nesting depth of the expression and not with its length. Output tokens are
+// handed to emit as soon as nothing can change them anymore, the arguments of
+// an expression function call included, they wait on the stack until its
+// closing parenthesis adds the body. Returns 0 with tokenizer->error set when
+// the expression is malformed.
+bool32 parseExpression(Tokenizer *tokenizer, EmitToken *emit, void *context) {
+  tokenizer->error[0] = '\0';
+  ListOfTokens output = {};
+
+  Token *operatorStack = 0;
+  size_t operatorStackCapacity = 0;
+  // NOTE(Hakan): For every open parenthesis on the operator stack, the number
+  // of commas seen inside it so far
+  size_t *argumentIndexStack = 0;
+  size_t argumentIndexStackCapacity = 0;
   size_t operatorStackCount = 0;
 
+  TokenType previousType = Token_Unknown;
+  bool32 isValid = true;
   bool32 isParsing = true;
-  while (isParsing) {
+  while (isParsing && isValid) {
     Token token = getToken(tokenizer);
+
+    // NOTE(Hakan): A call without an argument list would take its arguments
+    // from whatever is on the stack, and if() would have no branch markers
+    if (isCall(previousType) && (token.type != Token_OpenParen)) {
+      if (previousType == Token_Function) {
+        Function *function = &tokenizer->functions->functions[operatorStack[operatorStackCount - 1].index];
+        snprintf(tokenizer->error, ERROR_MESSAGE_SIZE, "Function %.*s is missing its argument list",
+                 (int)function->nameLength, function->name);
+      }
+      else {
+        snprintf(tokenizer->error, ERROR_MESSAGE_SIZE, "%s is missing its argument list",
+                 getOperator(previousType)->name);
+      }
+      isValid = 0;
+      break;
+    }
+
+    // NOTE(Hakan): Operands and operators have to alternate, otherwise postfix
+    // input like "1 2 +" would slip through
+    bool32 isOperandStart = (bool32)((token.type == Token_Number) || (token.type == Token_Identifier) ||
+                                     (token.type == Token_OpenParen) || isCall(token.type));
+    if (isOperandStart && isOperandEnd(previousType)) {
+      snprintf(tokenizer->error, ERROR_MESSAGE_SIZE, "Missing operator before %.*s",
+               (int)token.textLength, token.text);
+      isValid = 0;
+      break;
+    }
+    if (isBinaryOperator(token.type) && !isOperandEnd(previousType)) {
+      snprintf(tokenizer->error, ERROR_MESSAGE_SIZE, "Missing operand before %s", getOperator(token.type)->name);
+      isValid = 0;
+      break;
+    }
+    if (isBinaryOperator(previousType) &&
+        ((token.type == Token_CloseParen) || (token.type == Token_Comma) || (token.type == Token_EndOfStream))) {
+      snprintf(tokenizer->error, ERROR_MESSAGE_SIZE, "Missing operand after %s", getOperator(previousType)->name);
+      isValid = 0;
+      break;
+    }
+
     switch (token.type) {
       case Token_EndOfStream: {
         while (operatorStackCount != 0) {
-          result.tokens[result.count] = operatorStack[operatorStackCount - 1];
-          result.count++;
+          if (operatorStack[operatorStackCount - 1].type == Token_OpenParen) {
+            snprintf(tokenizer->error, ERROR_MESSAGE_SIZE, "Missing )");
+            isValid = 0;
+            break;
+          }
+
+          pushToken(&output, operatorStack[operatorStackCount - 1]);
           operatorStackCount--;
         }
         isParsing = false;
       } break;
 
       case Token_OpenParen: {
+        growArray(&operatorStack, &operatorStackCapacity, operatorStackCount + 1);
+        growArray(&argumentIndexStack, &argumentIndexStackCapacity, operatorStackCount + 1);
         operatorStack[operatorStackCount] = token;
+        argumentIndexStack[operatorStackCount] = 0;
         operatorStackCount++;
       } break;
 
+      case Token_Comma: {
+        while ((operatorStackCount > 0) &&
+               (operatorStack[operatorStackCount - 1].type != Token_OpenParen)) {
+          pushToken(&output, operatorStack[operatorStackCount - 1]);
+          operatorStackCount--;
+        }
+
+        if ((operatorStackCount < 2) || !isCall(operatorStack[operatorStackCount - 2].type)) {
+          snprintf(tokenizer->error, ERROR_MESSAGE_SIZE, "Unexpected , outside of a call");
+          isValid = 0;
+        }
+        else if ((previousType == Token_OpenParen) || (previousType == Token_Comma)) {
+          snprintf(tokenizer->error, ERROR_MESSAGE_SIZE, "Missing argument before ,");
+          isValid = 0;
+        }
+        else {
+          size_t parenIndex = operatorStackCount - 1;
+          argumentIndexStack[parenIndex]++;
+
+          if ((parenIndex > 0) && (operatorStack[parenIndex - 1].type == Token_OpIf) &&
+              (argumentIndexStack[parenIndex] <= 2)) {
+            Token marker = token;
+            marker.type = (argumentIndexStack[parenIndex] == 1) ? Token_IfThen : Token_IfElse;
+            pushToken(&output, marker);
+          }
+        }
+      } break;
+
       case Token_CloseParen: {
-        while ((operatorStack[operatorStackCount - 1].type != Token_OpenParen)) {
-          result.tokens[result.count] = operatorStack[operatorStackCount - 1];
-          result.count++;
+        while ((operatorStackCount > 0) &&
+               (operatorStack[operatorStackCount - 1].type != Token_OpenParen)) {
+          pushToken(&output, operatorStack[operatorStackCount - 1]);
           operatorStackCount--;
         }
+
+        if (operatorStackCount == 0) {
+          snprintf(tokenizer->error, ERROR_MESSAGE_SIZE, "Unmatched )");
+          isValid = 0;
+          break;
+        }
+        if (previousType == Token_Comma) {
+          snprintf(tokenizer->error, ERROR_MESSAGE_SIZE, "Missing argument before )");
+          isValid = 0;
+          break;
+        }
         // pop open paranthesis from operator stack
         operatorStackCount--;
+
+        // NOTE(Hakan): if() needs exactly three arguments or its branch markers
+        // don't line up, so every builtin call is checked
+        if ((operatorStackCount > 0) && isCall(operatorStack[operatorStackCount - 1].type) &&
+            (operatorStack[operatorStackCount - 1].type != Token_Function)) {
+          const Operator *call = getOperator(operatorStack[operatorStackCount - 1].type);
+          size_t argumentCount = (previousType == Token_OpenParen) ? 0 : (argumentIndexStack[operatorStackCount] + 1);
+          if (argumentCount != call->argumentCount) {
+            snprintf(tokenizer->error, ERROR_MESSAGE_SIZE, "%s takes %zu arguments, got %zu",
+                     call->name, call->argumentCount, argumentCount);
+            isValid = 0;
+          }
+        }
+        else if ((operatorStackCount > 0) && (operatorStack[operatorStackCount - 1].type == Token_Function)) {
+          Token call = operatorStack[operatorStackCount - 1];
+          Function *function = &tokenizer->functions->functions[call.index];
+          operatorStackCount--;
+
+          size_t argumentCount = (previousType == Token_OpenParen) ? 0 : (argumentIndexStack[operatorStackCount + 1] + 1);
+          if (argumentCount != function->argumentCount) {
+            snprintf(tokenizer->error, ERROR_MESSAGE_SIZE, "Function %.*s takes %zu arguments, got %zu",
+                     (int)function->nameLength, function->name, function->argumentCount, argumentCount);
+            isValid = 0;
+          }
+          else if (function->callback) {
+            pushToken(&output, call);
+          }
+          else {
+            inlineFunctionCall(&output, function);
+          }
+        }
       } break;
 
-      case Token_OpAdd:
-      case Token_OpSub:
-      case Token_OpMul:
-      case Token_OpDiv:
-      case Token_OpPow:
-      case Token_OpSin:
-      case Token_OpCos:
-      case Token_OpTan:
-      case Token_OpMax:
-      case Token_OpMin: {
+      case Token_Function: {
+        growArray(&operatorStack, &operatorStackCapacity, operatorStackCount + 1);
+        operatorStack[operatorStackCount] = token;
+        operatorStackCount++;
+      } break;
+
+#define HANDLE_OPERATOR(type, precedence, associativity, argumentCount) case Token_Op ## type:
+      LIST_OPERATORS {
+#undef HANDLE_OPERATOR
         while (operatorStackCount > 0) {
           Token *topOp = &operatorStack[operatorStackCount - 1];
-          bool32 isRightAssociative = operatorLookup[token.type - Token_OpStart].isRightAssociative;
-          size_t opPrecedence = operatorLookup[token.type - Token_OpStart].precedence;
-          size_t topOpPrecedence = operatorLookup[topOp->type - Token_OpStart].precedence;
-
-          if (((topOpPrecedence > opPrecedence) || ((topOpPrecedence == opPrecedence) && (!isRightAssociative))) &&
-               (topOp->type != Token_OpenParen)) {
-            result.tokens[result.count] = *topOp;
-            result.count++;
+          if ((topOp->type == Token_OpenParen) || (topOp->type == Token_Function)) {
+            break;
+          }
+
+          bool32 isRightAssociative = getOperator(token.type)->isRightAssociative;
+          size_t opPrecedence = getOperator(token.type)->precedence;
+          size_t topOpPrecedence = getOperator(topOp->type)->precedence;
+
+          if ((topOpPrecedence > opPrecedence) || ((topOpPrecedence == opPrecedence) && (!isRightAssociative))) {
+            pushToken(&output, *topOp);
             operatorStackCount--;
           }
           else {
@@ -334,16 +809,58 @@ ListOfTokens cStringToRTN(Tokenizer *tokenizer) {
           }
         }
 
+        growArray(&operatorStack, &operatorStackCapacity, operatorStackCount + 1);
         operatorStack[operatorStackCount] = token;
         operatorStackCount++;
       } break;
 
       case Token_Identifier:
       case Token_Number: {
-        result.tokens[result.count] = token;
-        result.count++;
+        pushToken(&output, token);
+      } break;
+
+      default: {
+        snprintf(tokenizer->error, ERROR_MESSAGE_SIZE, "Unexpected %.*s", (int)token.textLength, token.text);
+        isValid = 0;
       } break;
     }
+
+    // NOTE(Hakan): The text of tokens from a streaming tokenizer is only valid
+    // until the next refill, so they are emitted before the next getToken()
+    previousType = token.type;
+    for (size_t tokenIndex = 0; isValid && (tokenIndex < output.count); tokenIndex++) {
+      isValid = emit(context, &output.tokens[tokenIndex]);
+    }
+    output.count = 0;
+  }
+
+  // NOTE(Hakan): Whatever was parsed of an input that failed to read is only
+  // part of the expression
+  if (tokenizer->isInputFailed) {
+    snprintf(tokenizer->error, ERROR_MESSAGE_SIZE, "Failed to read the expression");
+    isValid = 0;
+  }
+
+  free(output.tokens);
+  free(operatorStack);
+  free(argumentIndexStack);
+  return isValid;
+}
+
+static bool32 emitToList(void *context, Token *token) {
+  pushToken((ListOfTokens*)context, *token);
+  return 1;
+}
+
+// NOTE(Hakan): Returns 0 with tokenizer->error set when the expression is
+// malformed, the RTN is empty then
+bool32 cStringToRTN(Tokenizer *tokenizer, ListOfTokens *rtn) {
+  ListOfTokens result = {};
+  result.functions = tokenizer->functions;
+  if (!parseExpression(tokenizer, emitToList, &result)) {
+    free(result.tokens);
+    result.tokens = 0;
+    result.count = result.capacity = 0;
   }
 
 #if 0
@@ -355,101 +872,1752 @@ ListOfTokens cStringToRTN(Tokenizer *tokenizer) {
   putc('\n', stdout);
 #endif
 
+  *rtn = result;
+  return (bool32)(tokenizer->error[0] == '\0');
+}
+
+static Function *addFunction(FunctionTable *table) {
+  if (table->count == table->capacity) {
+    table->capacity = (table->capacity == 0) ? 16 : 2 * table->capacity;
+    table->functions = (Function*)realloc(table->functions, sizeof(Function) * table->capacity);
+  }
+
+  Function *result = &table->functions[table->count];
+  *result = {};
+  table->count++;
   return result;
 }
 
-r64 evalExpression(Tokenizer *tokenizer) {
-  ListOfTokens rtn = cStringToRTN(tokenizer);
+// NOTE(Hakan): Defines a function from text like "f(x, y) = x*y + sin(x)". The
+// body may call functions that are already in the table.
+bool32 defineFunction(FunctionTable *table, const char *definition) {
+  size_t definitionLength = strlen(definition);
+  char *text = (char*)malloc(definitionLength + 1);
+  memcpy(text, definition, definitionLength + 1);
 
-  // NOTE(Hakan): The size of resultstack can never grow larger than the rtn
-  // representaion
-  r64 *resultStack = (r64*)alloca(sizeof(r64) * rtn.count);
-  size_t resultStackCount = 0;
+  Tokenizer tokenizer = {};
+  tokenizer.at = text;
+  tokenizer.functions = table;
+
+  Token name = getToken(&tokenizer);
+  bool32 isValid = (bool32)(((name.type == Token_Identifier) || (name.type == Token_Function)) &&
+                            (getToken(&tokenizer).type == Token_OpenParen));
+
+  Token parameters[FUNCTION_MAX_ARGUMENTS];
+  size_t parameterCount = 0;
+  while (isValid) {
+    Token token = getToken(&tokenizer);
+    if ((token.type == Token_CloseParen) && (parameterCount == 0)) {
+      break;
+    }
 
-  for (size_t tokenIndex = 0; tokenIndex < rtn.count; tokenIndex++) {
-    Token token = rtn.tokens[tokenIndex];
-    switch (token.type) {
-      case Token_OpAdd: {
-        r64 operandB = resultStack[resultStackCount - 1];
-        r64 operandA = resultStack[resultStackCount - 2];
-        resultStack[resultStackCount - 2] = operandA + operandB;
-        resultStackCount--;
-      } break;
-      case Token_OpSub:{
-        r64 operandB = resultStack[resultStackCount - 1];
-        r64 operandA = resultStack[resultStackCount - 2];
-        resultStack[resultStackCount - 2] = operandA - operandB;
-        resultStackCount--;
-      } break;
-      case Token_OpMul:{
-        r64 operandB = resultStack[resultStackCount - 1];
-        r64 operandA = resultStack[resultStackCount - 2];
-        resultStack[resultStackCount - 2] = operandA * operandB;
-        resultStackCount--;
-      } break;
-      case Token_OpDiv: {
-        r64 operandB = resultStack[resultStackCount - 1];
-        r64 operandA = resultStack[resultStackCount - 2];
-        resultStack[resultStackCount - 2] = operandA / operandB;
-        resultStackCount--;
-      } break;
-      case Token_OpPow: {
-        r64 operandB = resultStack[resultStackCount - 1];
-        r64 operandA = resultStack[resultStackCount - 2];
-        resultStack[resultStackCount - 2] = pow(operandA, operandB);
-        resultStackCount--;
-      } break;
-      case Token_OpSin: {
-        r64 operand = resultStack[resultStackCount - 1];
-        resultStack[resultStackCount - 1] = sin(operand);
-      } break;
-      case Token_OpCos: {
-        r64 operand = resultStack[resultStackCount - 1];
-        resultStack[resultStackCount - 1] = cos(operand);
-      } break;
-      case Token_OpTan: {
-        r64 operand = resultStack[resultStackCount - 1];
-        resultStack[resultStackCount - 1] = tan(operand);
-      } break;
-      case Token_OpMax: {
-        r64 operandB = resultStack[resultStackCount - 1];
-        r64 operandA = resultStack[resultStackCount - 2];
-        resultStack[resultStackCount - 2] = (operandA > operandB) ? operandA : operandB;
-        resultStackCount--;
-      } break;
-      case Token_OpMin: {
-        r64 operandB = resultStack[resultStackCount - 1];
-        r64 operandA = resultStack[resultStackCount - 2];
-        resultStack[resultStackCount - 2] = (operandA < operandB) ? operandA : operandB;
-        resultStackCount--;
-      } break;
+    if ((token.type != Token_Identifier) || (parameterCount == FUNCTION_MAX_ARGUMENTS)) {
+      isValid = 0;
+      break;
+    }
+    parameters[parameterCount] = token;
+    parameterCount++;
 
-      case Token_Identifier:
-      case Token_Number: {
-        resultStack[resultStackCount] = token.number;
-        resultStackCount++;
-      } break;
+    token = getToken(&tokenizer);
+    if (token.type == Token_CloseParen) {
+      break;
+    }
+    isValid = (bool32)(token.type == Token_Comma);
+  }
+
+  if (!isValid || (getToken(&tokenizer).type != Token_Assign)) {
+    free(text);
+    return 0;
+  }
+
+  ListOfTokens body;
+  if (!cStringToRTN(&tokenizer, &body)) {
+    free(text);
+    return 0;
+  }
+
+  // NOTE(Hakan): A body is spliced into every call, so one that doesn't leave
+  // exactly one value would take or leave values of the expression around it
+  size_t stackCount = 0;
+  for (size_t tokenIndex = 0; isValid && (tokenIndex < body.count); tokenIndex++) {
+    Token *token = &body.tokens[tokenIndex];
+    size_t popCount = 0;
+    size_t pushCount = 0;
+    if ((token->type == Token_Number) || (token->type == Token_Identifier) || (token->type == Token_LoadLocal)) {
+      pushCount = 1;
+    }
+    else if ((token->type == Token_StoreLocal) || (token->type == Token_IfThen)) {
+      popCount = 1;
+      pushCount = (token->type == Token_IfThen) ? 1 : 0;
+    }
+    else if ((token->type > Token_OpStart) && (token->type < Token_OpEnd)) {
+      popCount = getOperator(token->type)->argumentCount;
+      pushCount = 1;
+    }
+    else if (token->type == Token_Function) {
+      popCount = table->functions[token->index].argumentCount;
+      pushCount = 1;
+    }
+
+    isValid = (bool32)(stackCount >= popCount);
+    stackCount = stackCount - popCount + pushCount;
+  }
+
+  if (!isValid || (stackCount != 1)) {
+    free(body.tokens);
+    free(text);
+    return 0;
+  }
+
+  for (size_t tokenIndex = 0; tokenIndex < body.count; tokenIndex++) {
+    Token *token = &body.tokens[tokenIndex];
+    for (size_t parameterIndex = 0; parameterIndex < parameterCount; parameterIndex++) {
+      if ((token->type == Token_Identifier) &&
+          (token->textLength == parameters[parameterIndex].textLength) &&
+          (strncmp(token->text, parameters[parameterIndex].text, token->textLength) == 0)) {
+        token->type = Token_Argument;
+        token->index = parameterIndex;
+      }
     }
   }
 
-  free(rtn.tokens);
-  return resultStack[resultStackCount - 1];
+  Function *function = addFunction(table);
+  function->name = name.text;
+  function->nameLength = name.textLength;
+  function->argumentCount = parameterCount;
+  function->definition = text;
+  function->body = body;
+
+  return 1;
 }
 
-#ifndef TEST
-int main(int numArguments, char** arguments) {
-  if (numArguments < 2) {
-    printf("Usage: calc.exe expr");
+template <typename Number>
+bool32 defineNativeFunction(FunctionTable *table, const char *name, size_t argumentCount,
+                            NativeFunction<Number> callback, void *userData) {
+  if (argumentCount > FUNCTION_MAX_ARGUMENTS) {
     return 0;
   }
 
-  const char *expr = arguments[numArguments - 1];
+  size_t nameLength = strlen(name);
+  Function *function = addFunction(table);
+  function->name = (char*)malloc(nameLength + 1);
+  memcpy(function->name, name, nameLength + 1);
+  function->nameLength = nameLength;
+  function->argumentCount = argumentCount;
+  function->callback = (void*)callback;
+  function->userData = userData;
+  function->numberType = getNumberType<Number>();
+
+  return 1;
+}
 
-  Tokenizer tokenizer = {};
-  tokenizer.at = const_cast<char*>(expr);
+void freeFunctionTable(FunctionTable *table) {
+  for (size_t functionIndex = 0; functionIndex < table->count; functionIndex++) {
+    Function *function = &table->functions[functionIndex];
+    if (function->callback) {
+      free(function->name);
+    }
+    else {
+      free(function->definition);
+      free(function->body.tokens);
+    }
+  }
+
+  free(table->functions);
+  *table = {};
+}
+
+// NOTE(Hakan): A compiled program is the RTN with the source text stripped out.
+// Every instruction is a TokenType plus an operand that indexes the constant
+// pool (Token_Number), the variable table (Token_Identifier) or the function
+// table (Token_Function), or for Token_IfThen and Token_IfElse the index of
+// the instruction that ends the branch. The arrays of a program are laid out
+// the same way as in a record of a program image, so writing and loading an
+// image never has to touch getToken(). Token_StoreLocal and Token_LoadLocal
+// index the local slots that hold the arguments of inlined calls.
+// Constants are stored as the numberType the program was compiled for.
+struct Instruction {
+  u32 type;
+  u32 operand;
+};
+
+struct Program {
+  NumberType numberType;
+
+  void *constants;
+  size_t constantCount;
+
+  Instruction *code;
+  size_t codeCount;
+
+  // NOTE(Hakan): Variable names are null-terminated and packed back to back in
+  // variableNames, variableNameOffsets[index] is where the name of variable
+  // index starts.
+  u32 *variableNameOffsets;
+  size_t variableCount;
+  char *variableNames;
+  size_t variableNamesSize;
+
+  // NOTE(Hakan): stackSize counts the slots needed when both sides of every
+  // branch are evaluated, branchDepth is the deepest nesting of if()
+  size_t stackSize;
+  size_t branchDepth;
+  size_t localCount;
+
+  // NOTE(Hakan): Native functions are looked up here when they are called, it
+  // is null for programs that point into a program image
+  FunctionTable *functions;
+};
+
+enum LocalSource {
+  LocalSource_Stack,
+  LocalSource_Constant,
+  LocalSource_Variable,
+};
+
+struct LocalSlot {
+  LocalSource source;
+  u32 variable;
+};
+
+// NOTE(Hakan): A program being compiled one RTN token at a time, so it never
+// needs the whole RTN. Every array grows as instructions are added.
+struct ProgramBuilder {
+  Program program;
+  size_t constantsCapacity;
+  size_t codeCapacity;
+  size_t variablesCapacity;
+  size_t variableNamesCapacity;
+
+  size_t stackCount;
+
+  // NOTE(Hakan): IfThen instructions of the enclosing branches, their operand
+  // is the index of the matching IfElse once that has been emitted
+  size_t *pendingBranchStack;
+  size_t pendingBranchCount;
+  size_t pendingBranchCapacity;
+
+  // NOTE(Hakan): Open addressing hash of the variable names, a slot holds the
+  // index of the variable plus one or 0 when it is empty
+  u32 *variableSlots;
+  size_t variableSlotCount;
+
+  // NOTE(Hakan): Local slots that were last stored a constant or a variable,
+  // loading one compiles to a copy of the constant or a load of the variable.
+  // localValues holds numbers of the numberType of the program.
+  void *localValues;
+  size_t localValuesCapacity;
+  LocalSlot *localSlots;
+  size_t localSlotsCapacity;
+
+  // NOTE(Hakan): ERROR_MESSAGE_SIZE bytes that say why compiling failed
+  char *error;
+};
+
+// NOTE(Hakan): 32 bit FNV-1a
+static u32 checksum32(void *memory, size_t size) {
+  u32 result = 2166136261u;
+  unsigned char *at = (unsigned char*)memory;
+  for (size_t index = 0; index < size; index++) {
+    result ^= at[index];
+    result *= 16777619u;
+  }
+
+  return result;
+}
+
+static u32 *findVariableSlot(ProgramBuilder *builder, char *text, size_t textLength) {
+  Program *program = &builder->program;
+  size_t mask = builder->variableSlotCount - 1;
+  size_t slotIndex = checksum32(text, textLength) & mask;
+  for (;;) {
+    u32 *slot = &builder->variableSlots[slotIndex];
+    if (*slot == 0) {
+      return slot;
+    }
+
+    char *name = program->variableNames + program->variableNameOffsets[*slot - 1];
+    if ((strncmp(name, text, textLength) == 0) && (name[textLength] == '\0')) {
+      return slot;
+    }
+    slotIndex = (slotIndex + 1) & mask;
+  }
+}
+
+static u32 findOrAddVariable(ProgramBuilder *builder, Token *token) {
+  ASSERT(token->type == Token_Identifier);
+  Program *program = &builder->program;
+
+  u32 *slot = findVariableSlot(builder, token->text, token->textLength);
+  if (*slot != 0) {
+    return *slot - 1;
+  }
+
+  u32 result = (u32)program->variableCount;
+  growArray(&program->variableNameOffsets, &builder->variablesCapacity, program->variableCount + 1);
+  growArray(&program->variableNames, &builder->variableNamesCapacity,
+            program->variableNamesSize + token->textLength + 1);
+  program->variableNameOffsets[result] = (u32)program->variableNamesSize;
+  memcpy(program->variableNames + program->variableNamesSize, token->text, token->textLength);
+  program->variableNamesSize += token->textLength;
+  program->variableNames[program->variableNamesSize] = '\0';
+  program->variableNamesSize++;
+  program->variableCount++;
+  *slot = result + 1;
+
+  // NOTE(Hakan): Keep the table at most half full
+  if (2 * program->variableCount > builder->variableSlotCount) {
+    free(builder->variableSlots);
+    builder->variableSlotCount *= 2;
+    builder->variableSlots = (u32*)calloc(builder->variableSlotCount, sizeof(u32));
+    for (u32 variableIndex = 0; variableIndex < program->variableCount; variableIndex++) {
+      char *name = program->variableNames + program->variableNameOffsets[variableIndex];
+      *findVariableSlot(builder, name, strlen(name)) = variableIndex + 1;
+    }
+  }
+
+  return result;
+}
+
+template <typename Number>
+Number evalProgram(Program *program, Number *variables);
+
+static bool32 areLastInstructionsConstants(Program *program, size_t count) {
+  if (program->codeCount < count) {
+    return 0;
+  }
+
+  for (size_t index = program->codeCount - count; index < program->codeCount; index++) {
+    if (program->code[index].type != Token_Number) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+void beginProgram(ProgramBuilder *builder, NumberType numberType, FunctionTable *functions, char *error) {
+  *builder = {};
+  builder->program.numberType = numberType;
+  builder->program.functions = functions;
+  builder->error = error;
+  builder->error[0] = '\0';
+  builder->variableSlotCount = 16;
+  builder->variableSlots = (u32*)calloc(builder->variableSlotCount, sizeof(u32));
+}
+
+template <typename Number>
+static void addConstant(ProgramBuilder *builder, Instruction *instruction, Number value) {
+  Program *program = &builder->program;
+  Number *constants = (Number*)program->constants;
+  growArray(&constants, &builder->constantsCapacity, program->constantCount + 1);
+  program->constants = constants;
+
+  instruction->type = Token_Number;
+  instruction->operand = (u32)program->constantCount;
+  constants[program->constantCount] = value;
+  program->constantCount++;
+}
+
+template <typename Number>
+static void addLocalSlot(ProgramBuilder *builder, size_t slot) {
+  Program *program = &builder->program;
+  if (slot >= program->localCount) {
+    Number *localValues = (Number*)builder->localValues;
+    growArray(&localValues, &builder->localValuesCapacity, slot + 1);
+    builder->localValues = localValues;
+    growArray(&builder->localSlots, &builder->localSlotsCapacity, slot + 1);
+    memset(builder->localSlots + program->localCount, 0, sizeof(LocalSlot) * (slot + 1 - program->localCount));
+    program->localCount = slot + 1;
+  }
+}
+
+// NOTE(Hakan): Compiles the next token of the RTN, matches EmitToken so the
+// parser can hand tokens straight to a builder
+template <typename Number>
+static bool32 compileToken(void *context, Token *token) {
+  ProgramBuilder *builder = (ProgramBuilder*)context;
+  Program *program = &builder->program;
+  ASSERT(program->numberType == getNumberType<Number>());
+
+  growArray(&program->code, &builder->codeCapacity, program->codeCount + 1);
+  Instruction *instruction = &program->code[program->codeCount];
+  instruction->type = token->type;
+  instruction->operand = 0;
+
+  if (token->type == Token_Number) {
+    addConstant(builder, instruction, numberTokenToValue<Number>(token));
+    builder->stackCount++;
+  }
+  else if (token->type == Token_Identifier) {
+    instruction->operand = findOrAddVariable(builder, token);
+    builder->stackCount++;
+  }
+  else if (token->type == Token_StoreLocal) {
+    if (builder->stackCount == 0) {
+      snprintf(builder->error, ERROR_MESSAGE_SIZE, "Function %.*s is missing an argument",
+               (int)token->textLength, token->text);
+      return 0;
+    }
+
+    size_t slot = token->index;
+    addLocalSlot<Number>(builder, slot);
+    builder->stackCount--;
+
+    // NOTE(Hakan): A constant argument takes no instruction at all, the
+    // loads of it become constants and fold with the rest of the body. A
+    // variable argument is loaded from the variables wherever it is used.
+    if (areLastInstructionsConstants(program, 1)) {
+      program->codeCount--;
+      size_t constantIndex = program->code[program->codeCount].operand;
+      ((Number*)builder->localValues)[slot] = ((Number*)program->constants)[constantIndex];
+      if (constantIndex + 1 == program->constantCount) {
+        program->constantCount--;
+      }
+      builder->localSlots[slot].source = LocalSource_Constant;
+      return 1;
+    }
+    if ((program->codeCount > 0) && (program->code[program->codeCount - 1].type == Token_Identifier)) {
+      program->codeCount--;
+      builder->localSlots[slot].source = LocalSource_Variable;
+      builder->localSlots[slot].variable = program->code[program->codeCount].operand;
+      return 1;
+    }
+
+    builder->localSlots[slot].source = LocalSource_Stack;
+    instruction->operand = (u32)slot;
+  }
+  else if (token->type == Token_LoadLocal) {
+    size_t slot = token->index;
+    addLocalSlot<Number>(builder, slot);
+    if (builder->localSlots[slot].source == LocalSource_Constant) {
+      addConstant(builder, instruction, ((Number*)builder->localValues)[slot]);
+    }
+    else if (builder->localSlots[slot].source == LocalSource_Variable) {
+      instruction->type = Token_Identifier;
+      instruction->operand = builder->localSlots[slot].variable;
+    }
+    else {
+      instruction->operand = (u32)slot;
+    }
+    builder->stackCount++;
+  }
+  else if (token->type == Token_IfThen) {
+    if (builder->stackCount == 0) {
+      snprintf(builder->error, ERROR_MESSAGE_SIZE, "if() is missing its condition");
+      return 0;
+    }
+
+    growArray(&builder->pendingBranchStack, &builder->pendingBranchCapacity, builder->pendingBranchCount + 1);
+    builder->pendingBranchStack[builder->pendingBranchCount] = program->codeCount;
+    builder->pendingBranchCount++;
+    if (builder->pendingBranchCount > program->branchDepth) {
+      program->branchDepth = builder->pendingBranchCount;
+    }
+  }
+  else if (token->type == Token_IfElse) {
+    if (builder->pendingBranchCount == 0) {
+      snprintf(builder->error, ERROR_MESSAGE_SIZE, "if() is missing its condition");
+      return 0;
+    }
+    program->code[builder->pendingBranchStack[builder->pendingBranchCount - 1]].operand = (u32)program->codeCount;
+  }
+  else if ((token->type > Token_OpStart) && (token->type < Token_OpEnd)) {
+    size_t argumentCount = getOperator(token->type)->argumentCount;
+    if (builder->stackCount < argumentCount) {
+      snprintf(builder->error, ERROR_MESSAGE_SIZE, "Operator %s is missing an operand",
+               getOperator(token->type)->name);
+      return 0;
+    }
+    builder->stackCount -= argumentCount - 1;
+
+    if (token->type == Token_OpIf) {
+      // NOTE(Hakan): An if() without its IfThen and IfElse markers can't come
+      // from parseExpression(), but compileProgram() takes any RTN
+      size_t thenIndex = builder->pendingBranchCount ? builder->pendingBranchStack[builder->pendingBranchCount - 1] : 0;
+      size_t elseIndex = builder->pendingBranchCount ? program->code[thenIndex].operand : 0;
+      if ((elseIndex == 0) || (program->code[elseIndex].type != Token_IfElse)) {
+        snprintf(builder->error, ERROR_MESSAGE_SIZE, "if() is missing its branches");
+        return 0;
+      }
+      program->code[elseIndex].operand = (u32)program->codeCount;
+      builder->pendingBranchCount--;
+
+      // NOTE(Hakan): With a constant condition only the branch that is taken
+      // is kept, jumps of the branches nested inside it move along with it
+      size_t conditionIndex = thenIndex - 1;
+      if (program->code[conditionIndex].type == Token_Number) {
+        Number *constants = (Number*)program->constants;
+        bool32 isTaken = (bool32)(constants[program->code[conditionIndex].operand] != numberFromBool<Number>(0));
+        size_t keptStart = isTaken ? (thenIndex + 1) : (elseIndex + 1);
+        size_t keptEnd = isTaken ? elseIndex : program->codeCount;
+        size_t shift = keptStart - conditionIndex;
+
+        for (size_t codeIndex = keptStart; codeIndex < keptEnd; codeIndex++) {
+          Instruction kept = program->code[codeIndex];
+          if ((kept.type == Token_IfThen) || (kept.type == Token_IfElse)) {
+            kept.operand -= (u32)shift;
+          }
+          program->code[codeIndex - shift] = kept;
+        }
+        program->codeCount = conditionIndex + (keptEnd - keptStart);
+        return 1;
+      }
+    }
+
+    // NOTE(Hakan): Operators whose operands are all constants are evaluated
+    // right away, which is what collapses inlined function bodies
+    else if (areLastInstructionsConstants(program, argumentCount)) {
+      Program folded = *program;
+      folded.code = &program->code[program->codeCount - argumentCount];
+      folded.codeCount = argumentCount + 1;
+      folded.stackSize = argumentCount;
+      Number value = evalProgram(&folded, (Number*)0);
+
+      // NOTE(Hakan): The constants of the operands are reused when nothing
+      // was added to the pool after them
+      program->codeCount -= argumentCount;
+      size_t firstOperand = program->code[program->codeCount].operand;
+      if (firstOperand + argumentCount == program->constantCount) {
+        program->constantCount = firstOperand;
+      }
+
+      addConstant(builder, &program->code[program->codeCount], value);
+    }
+  }
+  else if (token->type == Token_Function) {
+    Function *function = &program->functions->functions[token->index];
+    ASSERT(function->callback);
+    if (function->numberType != getNumberType<Number>()) {
+      snprintf(builder->error, ERROR_MESSAGE_SIZE, "Function %.*s can't be called from a %s program",
+               (int)function->nameLength, function->name, getNumberTypeName(getNumberType<Number>()));
+      return 0;
+    }
+    if (builder->stackCount < function->argumentCount) {
+      snprintf(builder->error, ERROR_MESSAGE_SIZE, "Function %.*s is missing an argument",
+               (int)function->nameLength, function->name);
+      return 0;
+    }
+
+    instruction->operand = (u32)token->index;
+    builder->stackCount = builder->stackCount + 1 - function->argumentCount;
+  }
+  else {
+    return 1;
+  }
+
+  if (builder->stackCount > program->stackSize) {
+    program->stackSize = builder->stackCount;
+  }
+  program->codeCount++;
+  return 1;
+}
+
+struct OpenBranch {
+  size_t thenIndex;
+  size_t elseIndex;
+  size_t stackCount;
+};
+
+// NOTE(Hakan): One pass over the code that checks every operand is in bounds,
+// that branches nest as IfThen, IfElse, OpIf with the jumps pointing at the
+// matching instructions, and that each branch adds exactly one value without
+// touching what was on the stack before it. Measures the stack size, branch
+// depth and local slots evaluating the program needs. Native function calls
+// are only valid in a program with a function table. Returns 0 for code that
+// the evaluators can't run safely.
+static bool32 measureProgram(Program *program, size_t *stackSize, size_t *branchDepth, size_t *localCount) {
+  OpenBranch *branchStack = 0;
+  size_t branchCapacity = 0;
+  size_t branchCount = 0;
+
+  // NOTE(Hakan): The sizes may be measured into the program itself
+  size_t localLimit = program->localCount;
+
+  size_t stackCount = 0;
+  // NOTE(Hakan): The values below floorCount belong to enclosing branches
+  size_t floorCount = 0;
+  *stackSize = 0;
+  *branchDepth = 0;
+  *localCount = 0;
+
+  bool32 isValid = 1;
+  for (size_t codeIndex = 0; isValid && (codeIndex < program->codeCount); codeIndex++) {
+    Instruction instruction = program->code[codeIndex];
+    size_t popCount = 0;
+    size_t pushCount = 0;
+
+    if (instruction.type == Token_Number) {
+      isValid = (bool32)(instruction.operand < program->constantCount);
+      pushCount = 1;
+    }
+    else if (instruction.type == Token_Identifier) {
+      isValid = (bool32)(instruction.operand < program->variableCount);
+      pushCount = 1;
+    }
+    else if ((instruction.type == Token_StoreLocal) || (instruction.type == Token_LoadLocal)) {
+      isValid = (bool32)(instruction.operand < localLimit);
+      if (instruction.operand + 1 > *localCount) {
+        *localCount = instruction.operand + 1;
+      }
+      popCount = (instruction.type == Token_StoreLocal) ? 1 : 0;
+      pushCount = (instruction.type == Token_LoadLocal) ? 1 : 0;
+    }
+    else if (instruction.type == Token_Function) {
+      isValid = (bool32)(program->functions && (instruction.operand < program->functions->count) &&
+                         program->functions->functions[instruction.operand].callback);
+      popCount = isValid ? program->functions->functions[instruction.operand].argumentCount : 0;
+      pushCount = 1;
+    }
+    else if (instruction.type == Token_IfThen) {
+      isValid = (bool32)((stackCount > floorCount) &&
+                         (instruction.operand > codeIndex) && (instruction.operand < program->codeCount));
+
+      growArray(&branchStack, &branchCapacity, branchCount + 1);
+      branchStack[branchCount].thenIndex = codeIndex;
+      branchStack[branchCount].elseIndex = 0;
+      branchStack[branchCount].stackCount = stackCount;
+      branchCount++;
+      floorCount = stackCount;
+      if (branchCount > *branchDepth) {
+        *branchDepth = branchCount;
+      }
+    }
+    else if (instruction.type == Token_IfElse) {
+      OpenBranch *branch = (branchCount > 0) ? &branchStack[branchCount - 1] : 0;
+      isValid = (bool32)(branch && (branch->elseIndex == 0) &&
+                         (program->code[branch->thenIndex].operand == codeIndex) &&
+                         (stackCount == branch->stackCount + 1) &&
+                         (instruction.operand > codeIndex) && (instruction.operand < program->codeCount));
+      if (isValid) {
+        branch->elseIndex = codeIndex;
+        floorCount = stackCount;
+      }
+    }
+    else if (instruction.type == Token_OpIf) {
+      OpenBranch *branch = (branchCount > 0) ? &branchStack[branchCount - 1] : 0;
+      isValid = (bool32)(branch && (branch->elseIndex != 0) &&
+                         (program->code[branch->elseIndex].operand == codeIndex) &&
+                         (stackCount == branch->stackCount + 2));
+      if (isValid) {
+        stackCount = branch->stackCount;
+        branchCount--;
+        floorCount = 0;
+        if (branchCount > 0) {
+          branch = &branchStack[branchCount - 1];
+          floorCount = branch->stackCount + ((branch->elseIndex != 0) ? 1 : 0);
+        }
+      }
+    }
+    else if ((instruction.type > Token_OpStart) && (instruction.type < Token_OpEnd)) {
+      popCount = getOperator(instruction.type)->argumentCount;
+      pushCount = 1;
+    }
+    else {
+      isValid = 0;
+    }
+
+    if (isValid && (stackCount >= floorCount + popCount)) {
+      stackCount = stackCount - popCount + pushCount;
+      if (stackCount > *stackSize) {
+        *stackSize = stackCount;
+      }
+    }
+    else {
+      isValid = 0;
+    }
+  }
+
+  free(branchStack);
+  return (bool32)(isValid && (branchCount == 0) && (stackCount == 1));
+}
+
+void freeProgram(Program *program) {
+  free(program->constants);
+  free(program->code);
+  free(program->variableNameOffsets);
+  free(program->variableNames);
+  *program = {};
+}
+
+// NOTE(Hakan): Hands over the program and frees what was only needed while
+// compiling, the arrays are trimmed to what the program uses. Pass isValid 0
+// when compiling was stopped early to throw the program away.
+bool32 endProgram(ProgramBuilder *builder, Program *program, bool32 isValid) {
+  if (isValid && (builder->stackCount != 1)) {
+    snprintf(builder->error, ERROR_MESSAGE_SIZE, "%s",
+             (builder->stackCount == 0) ? "Empty expression" : "Missing operator between values");
+    isValid = 0;
+  }
+
+  Program result = builder->program;
+  char *error = builder->error;
+  free(builder->pendingBranchStack);
+  free(builder->variableSlots);
+  free(builder->localValues);
+  free(builder->localSlots);
+  *builder = {};
+
+  if (!isValid) {
+    freeProgram(&result);
+    *program = {};
+    return 0;
+  }
+
+  size_t constantsSize = getNumberTypeSize(result.numberType) * result.constantCount;
+  if (constantsSize > 0) {
+    result.constants = realloc(result.constants, constantsSize);
+  }
+  if (result.codeCount > 0) {
+    result.code = (Instruction*)realloc(result.code, sizeof(Instruction) * result.codeCount);
+  }
+
+  // NOTE(Hakan): Folding and dropped branches leave the sizes seen while
+  // compiling larger than what the program needs. The exact ones are what a
+  // program image is checked against when it is loaded.
+  if (!measureProgram(&result, &result.stackSize, &result.branchDepth, &result.localCount)) {
+    snprintf(error, ERROR_MESSAGE_SIZE, "Compiled an invalid program");
+    freeProgram(&result);
+    *program = {};
+    return 0;
+  }
+
+  *program = result;
+  return 1;
+}
+
+// NOTE(Hakan): error has to hold ERROR_MESSAGE_SIZE bytes
+template <typename Number>
+bool32 compileProgram(ListOfTokens *rtn, Program *program, char *error) {
+  ProgramBuilder builder;
+  beginProgram(&builder, getNumberType<Number>(), rtn->functions, error);
+  bool32 isValid = 1;
+  for (size_t tokenIndex = 0; isValid && (tokenIndex < rtn->count); tokenIndex++) {
+    isValid = compileToken<Number>(&builder, &rtn->tokens[tokenIndex]);
+  }
+
+  return endProgram(&builder, program, isValid);
+}
+
+// NOTE(Hakan): Parses and compiles in one pass without ever holding the RTN of
+// the whole expression, which is how large and streamed expressions are read.
+// Returns 0 with tokenizer->error set when the expression doesn't compile.
+template <typename Number>
+bool32 compileExpression(Tokenizer *tokenizer, Program *program) {
+  ProgramBuilder builder;
+  beginProgram(&builder, getNumberType<Number>(), tokenizer->functions, tokenizer->error);
+  bool32 isValid = parseExpression(tokenizer, compileToken<Number>, &builder);
+
+  return endProgram(&builder, program, isValid);
+}
+
+#define EVAL_LOCAL_STACK_SIZE 64
+
+template <typename Number>
+Number evalProgram(Program *program, Number *variables) {
+  ASSERT(program->numberType == getNumberType<Number>());
+
+  const Number zero = numberFromBool<Number>(0);
+  Number *constants = (Number*)program->constants;
+
+  // NOTE(Hakan): Deeply nested expressions get their stack from the heap, the
+  // local slots come after the stack
+  Number localStack[EVAL_LOCAL_STACK_SIZE];
+  Number *resultStack = localStack;
+  if (program->stackSize + program->localCount > EVAL_LOCAL_STACK_SIZE) {
+    resultStack = (Number*)malloc(sizeof(Number) * (program->stackSize + program->localCount));
+  }
+  Number *locals = resultStack + program->stackSize;
+  size_t resultStackCount = 0;
+
+  for (size_t codeIndex = 0; codeIndex < program->codeCount; codeIndex++) {
+    Instruction instruction = program->code[codeIndex];
+    switch (instruction.type) {
+      case Token_OpAdd: {
+        Number operandB = resultStack[resultStackCount - 1];
+        Number operandA = resultStack[resultStackCount - 2];
+        resultStack[resultStackCount - 2] = operandA + operandB;
+        resultStackCount--;
+      } break;
+      case Token_OpSub:{
+        Number operandB = resultStack[resultStackCount - 1];
+        Number operandA = resultStack[resultStackCount - 2];
+        resultStack[resultStackCount - 2] = operandA - operandB;
+        resultStackCount--;
+      } break;
+      case Token_OpMul:{
+        Number operandB = resultStack[resultStackCount - 1];
+        Number operandA = resultStack[resultStackCount - 2];
+        resultStack[resultStackCount - 2] = operandA * operandB;
+        resultStackCount--;
+      } break;
+      case Token_OpDiv: {
+        Number operandB = resultStack[resultStackCount - 1];
+        Number operandA = resultStack[resultStackCount - 2];
+        resultStack[resultStackCount - 2] = operandA / operandB;
+        resultStackCount--;
+      } break;
+      case Token_OpPow: {
+        Number operandB = resultStack[resultStackCount - 1];
+        Number operandA = resultStack[resultStackCount - 2];
+        resultStack[resultStackCount - 2] = numberPow(operandA, operandB);
+        resultStackCount--;
+      } break;
+      case Token_OpSin: {
+        Number operand = resultStack[resultStackCount - 1];
+        resultStack[resultStackCount - 1] = numberSin(operand);
+      } break;
+      case Token_OpCos: {
+        Number operand = resultStack[resultStackCount - 1];
+        resultStack[resultStackCount - 1] = numberCos(operand);
+      } break;
+      case Token_OpTan: {
+        Number operand = resultStack[resultStackCount - 1];
+        resultStack[resultStackCount - 1] = numberTan(operand);
+      } break;
+      case Token_OpMax: {
+        Number operandB = resultStack[resultStackCount - 1];
+        Number operandA = resultStack[resultStackCount - 2];
+        resultStack[resultStackCount - 2] = (operandA > operandB) ? operandA : operandB;
+        resultStackCount--;
+      } break;
+      case Token_OpMin: {
+        Number operandB = resultStack[resultStackCount - 1];
+        Number operandA = resultStack[resultStackCount - 2];
+        resultStack[resultStackCount - 2] = (operandA < operandB) ? operandA : operandB;
+        resultStackCount--;
+      } break;
+
+      case Token_OpOr: {
+        Number operandB = resultStack[resultStackCount - 1];
+        Number operandA = resultStack[resultStackCount - 2];
+        resultStack[resultStackCount - 2] = numberFromBool<Number>((bool32)((operandA != zero) | (operandB != zero)));
+        resultStackCount--;
+      } break;
+      case Token_OpAnd: {
+        Number operandB = resultStack[resultStackCount - 1];
+        Number operandA = resultStack[resultStackCount - 2];
+        resultStack[resultStackCount - 2] = numberFromBool<Number>((bool32)((operandA != zero) & (operandB != zero)));
+        resultStackCount--;
+      } break;
+      case Token_OpEqual: {
+        Number operandB = resultStack[resultStackCount - 1];
+        Number operandA = resultStack[resultStackCount - 2];
+        resultStack[resultStackCount - 2] = numberFromBool<Number>((bool32)(operandA == operandB));
+        resultStackCount--;
+      } break;
+      case Token_OpNotEqual: {
+        Number operandB = resultStack[resultStackCount - 1];
+        Number operandA = resultStack[resultStackCount - 2];
+        resultStack[resultStackCount - 2] = numberFromBool<Number>((bool32)(operandA != operandB));
+        resultStackCount--;
+      } break;
+      case Token_OpLess: {
+        Number operandB = resultStack[resultStackCount - 1];
+        Number operandA = resultStack[resultStackCount - 2];
+        resultStack[resultStackCount - 2] = numberFromBool<Number>((bool32)(operandA < operandB));
+        resultStackCount--;
+      } break;
+      case Token_OpLessEqual: {
+        Number operandB = resultStack[resultStackCount - 1];
+        Number operandA = resultStack[resultStackCount - 2];
+        resultStack[resultStackCount - 2] = numberFromBool<Number>((bool32)(operandA <= operandB));
+        resultStackCount--;
+      } break;
+      case Token_OpGreater: {
+        Number operandB = resultStack[resultStackCount - 1];
+        Number operandA = resultStack[resultStackCount - 2];
+        resultStack[resultStackCount - 2] = numberFromBool<Number>((bool32)(operandA > operandB));
+        resultStackCount--;
+      } break;
+      case Token_OpGreaterEqual: {
+        Number operandB = resultStack[resultStackCount - 1];
+        Number operandA = resultStack[resultStackCount - 2];
+        resultStack[resultStackCount - 2] = numberFromBool<Number>((bool32)(operandA >= operandB));
+        resultStackCount--;
+      } break;
+
+      // NOTE(Hakan): Only the branch that is taken gets evaluated, both
+      // IfThen and IfElse jump to the instruction that ends their branch
+      case Token_IfThen: {
+        Number condition = resultStack[resultStackCount - 1];
+        resultStackCount--;
+        if (condition == zero) {
+          codeIndex = instruction.operand;
+        }
+      } break;
+      case Token_IfElse: {
+        codeIndex = instruction.operand;
+      } break;
+      case Token_OpIf: {
+      } break;
+
+      case Token_Function: {
+        Function *function = &program->functions->functions[instruction.operand];
+        Number *arguments[FUNCTION_MAX_ARGUMENTS];
+        for (size_t argumentIndex = 0; argumentIndex < function->argumentCount; argumentIndex++) {
+          arguments[argumentIndex] = &resultStack[resultStackCount - function->argumentCount + argumentIndex];
+        }
+
+        Number result;
+        ((NativeFunction<Number>)function->callback)(arguments, &result, 1, function->userData);
+        resultStackCount -= function->argumentCount;
+        resultStack[resultStackCount] = result;
+        resultStackCount++;
+      } break;
+
+      case Token_Number: {
+        resultStack[resultStackCount] = constants[instruction.operand];
+        resultStackCount++;
+      } break;
+      case Token_Identifier: {
+        resultStack[resultStackCount] = variables[instruction.operand];
+        resultStackCount++;
+      } break;
+      case Token_StoreLocal: {
+        resultStackCount--;
+        locals[instruction.operand] = resultStack[resultStackCount];
+      } break;
+      case Token_LoadLocal: {
+        resultStack[resultStackCount] = locals[instruction.operand];
+        resultStackCount++;
+      } break;
+    }
+  }
+
+  // NOTE(Hakan): Only an empty program leaves nothing on the stack
+  Number result = (resultStackCount > 0) ? resultStack[resultStackCount - 1] : zero;
+  if (resultStack != localStack) {
+    free(resultStack);
+  }
+
+  return result;
+}
+
+// NOTE(Hakan): Evaluates a program for rowCount rows at once, variables[index]
+// is the column of values for variable index. Rows are processed in blocks of
+// BATCH_LANE_COUNT and every instruction loops over a whole block, so
+// comparisons and if() become masked selects instead of per row branches. A
+// branch is only skipped when the condition is the same for the whole block.
+#define BATCH_LANE_COUNT 256
+
+template <typename Number>
+void evalProgramBatch(Program *program, Number **variables, size_t rowCount, Number *results) {
+  ASSERT(program->numberType == getNumberType<Number>());
+
+  const Number zero = numberFromBool<Number>(0);
+  Number *constants = (Number*)program->constants;
+  Number *resultStack = (Number*)malloc(sizeof(Number) * BATCH_LANE_COUNT * (program->stackSize + 1 + program->localCount) +
+                                        sizeof(bool32) * program->branchDepth);
+  // NOTE(Hakan): Native functions write their results here before they
+  // replace the arguments on the stack
+  Number *functionResults = resultStack + BATCH_LANE_COUNT * program->stackSize;
+  Number *locals = functionResults + BATCH_LANE_COUNT;
+  // NOTE(Hakan): For every if() being evaluated, whether its condition differs
+  // between rows of the block and both branches are on the stack
+  bool32 *isBranchMixedStack = (bool32*)(locals + BATCH_LANE_COUNT * program->localCount);
+
+  for (size_t rowIndex = 0; rowIndex < rowCount; rowIndex += BATCH_LANE_COUNT) {
+    size_t laneCount = rowCount - rowIndex;
+    if (laneCount > BATCH_LANE_COUNT) {
+      laneCount = BATCH_LANE_COUNT;
+    }
+
+    size_t resultStackCount = 0;
+    size_t branchCount = 0;
+
+    for (size_t codeIndex = 0; codeIndex < program->codeCount; codeIndex++) {
+      Instruction instruction = program->code[codeIndex];
+      switch (instruction.type) {
+        case Token_OpOr: {
+          Number *operandB = &resultStack[(resultStackCount - 1) * BATCH_LANE_COUNT];
+          Number *operandA = &resultStack[(resultStackCount - 2) * BATCH_LANE_COUNT];
+          for (size_t lane = 0; lane < laneCount; lane++) {
+            operandA[lane] = numberFromBool<Number>((bool32)((operandA[lane] != zero) | (operandB[lane] != zero)));
+          }
+          resultStackCount--;
+        } break;
+        case Token_OpAnd: {
+          Number *operandB = &resultStack[(resultStackCount - 1) * BATCH_LANE_COUNT];
+          Number *operandA = &resultStack[(resultStackCount - 2) * BATCH_LANE_COUNT];
+          for (size_t lane = 0; lane < laneCount; lane++) {
+            operandA[lane] = numberFromBool<Number>((bool32)((operandA[lane] != zero) & (operandB[lane] != zero)));
+          }
+          resultStackCount--;
+        } break;
+        case Token_OpEqual: {
+          Number *operandB = &resultStack[(resultStackCount - 1) * BATCH_LANE_COUNT];
+          Number *operandA = &resultStack[(resultStackCount - 2) * BATCH_LANE_COUNT];
+          for (size_t lane = 0; lane < laneCount; lane++) {
+            operandA[lane] = numberFromBool<Number>((bool32)(operandA[lane] == operandB[lane]));
+          }
+          resultStackCount--;
+        } break;
+        case Token_OpNotEqual: {
+          Number *operandB = &resultStack[(resultStackCount - 1) * BATCH_LANE_COUNT];
+          Number *operandA = &resultStack[(resultStackCount - 2) * BATCH_LANE_COUNT];
+          for (size_t lane = 0; lane < laneCount; lane++) {
+            operandA[lane] = numberFromBool<Number>((bool32)(operandA[lane] != operandB[lane]));
+          }
+          resultStackCount--;
+        } break;
+        case Token_OpLess: {
+          Number *operandB = &resultStack[(resultStackCount - 1) * BATCH_LANE_COUNT];
+          Number *operandA = &resultStack[(resultStackCount - 2) * BATCH_LANE_COUNT];
+          for (size_t lane = 0; lane < laneCount; lane++) {
+            operandA[lane] = numberFromBool<Number>((bool32)(operandA[lane] < operandB[lane]));
+          }
+          resultStackCount--;
+        } break;
+        case Token_OpLessEqual: {
+          Number *operandB = &resultStack[(resultStackCount - 1) * BATCH_LANE_COUNT];
+          Number *operandA = &resultStack[(resultStackCount - 2) * BATCH_LANE_COUNT];
+          for (size_t lane = 0; lane < laneCount; lane++) {
+            operandA[lane] = numberFromBool<Number>((bool32)(operandA[lane] <= operandB[lane]));
+          }
+          resultStackCount--;
+        } break;
+        case Token_OpGreater: {
+          Number *operandB = &resultStack[(resultStackCount - 1) * BATCH_LANE_COUNT];
+          Number *operandA = &resultStack[(resultStackCount - 2) * BATCH_LANE_COUNT];
+          for (size_t lane = 0; lane < laneCount; lane++) {
+            operandA[lane] = numberFromBool<Number>((bool32)(operandA[lane] > operandB[lane]));
+          }
+          resultStackCount--;
+        } break;
+        case Token_OpGreaterEqual: {
+          Number *operandB = &resultStack[(resultStackCount - 1) * BATCH_LANE_COUNT];
+          Number *operandA = &resultStack[(resultStackCount - 2) * BATCH_LANE_COUNT];
+          for (size_t lane = 0; lane < laneCount; lane++) {
+            operandA[lane] = numberFromBool<Number>((bool32)(operandA[lane] >= operandB[lane]));
+          }
+          resultStackCount--;
+        } break;
+        case Token_OpAdd: {
+          Number *operandB = &resultStack[(resultStackCount - 1) * BATCH_LANE_COUNT];
+          Number *operandA = &resultStack[(resultStackCount - 2) * BATCH_LANE_COUNT];
+          for (size_t lane = 0; lane < laneCount; lane++) {
+            operandA[lane] = operandA[lane] + operandB[lane];
+          }
+          resultStackCount--;
+        } break;
+        case Token_OpSub: {
+          Number *operandB = &resultStack[(resultStackCount - 1) * BATCH_LANE_COUNT];
+          Number *operandA = &resultStack[(resultStackCount - 2) * BATCH_LANE_COUNT];
+          for (size_t lane = 0; lane < laneCount; lane++) {
+            operandA[lane] = operandA[lane] - operandB[lane];
+          }
+          resultStackCount--;
+        } break;
+        case Token_OpMul: {
+          Number *operandB = &resultStack[(resultStackCount - 1) * BATCH_LANE_COUNT];
+          Number *operandA = &resultStack[(resultStackCount - 2) * BATCH_LANE_COUNT];
+          for (size_t lane = 0; lane < laneCount; lane++) {
+            operandA[lane] = operandA[lane] * operandB[lane];
+          }
+          resultStackCount--;
+        } break;
+        case Token_OpDiv: {
+          Number *operandB = &resultStack[(resultStackCount - 1) * BATCH_LANE_COUNT];
+          Number *operandA = &resultStack[(resultStackCount - 2) * BATCH_LANE_COUNT];
+          for (size_t lane = 0; lane < laneCount; lane++) {
+            operandA[lane] = operandA[lane] / operandB[lane];
+          }
+          resultStackCount--;
+        } break;
+        case Token_OpPow: {
+          Number *operandB = &resultStack[(resultStackCount - 1) * BATCH_LANE_COUNT];
+          Number *operandA = &resultStack[(resultStackCount - 2) * BATCH_LANE_COUNT];
+          for (size_t lane = 0; lane < laneCount; lane++) {
+            operandA[lane] = numberPow(operandA[lane], operandB[lane]);
+          }
+          resultStackCount--;
+        } break;
+        case Token_OpSin: {
+          Number *operand = &resultStack[(resultStackCount - 1) * BATCH_LANE_COUNT];
+          for (size_t lane = 0; lane < laneCount; lane++) {
+            operand[lane] = numberSin(operand[lane]);
+          }
+        } break;
+        case Token_OpCos: {
+          Number *operand = &resultStack[(resultStackCount - 1) * BATCH_LANE_COUNT];
+          for (size_t lane = 0; lane < laneCount; lane++) {
+            operand[lane] = numberCos(operand[lane]);
+          }
+        } break;
+        case Token_OpTan: {
+          Number *operand = &resultStack[(resultStackCount - 1) * BATCH_LANE_COUNT];
+          for (size_t lane = 0; lane < laneCount; lane++) {
+            operand[lane] = numberTan(operand[lane]);
+          }
+        } break;
+        case Token_OpMax: {
+          Number *operandB = &resultStack[(resultStackCount - 1) * BATCH_LANE_COUNT];
+          Number *operandA = &resultStack[(resultStackCount - 2) * BATCH_LANE_COUNT];
+          for (size_t lane = 0; lane < laneCount; lane++) {
+            operandA[lane] = (operandA[lane] > operandB[lane]) ? operandA[lane] : operandB[lane];
+          }
+          resultStackCount--;
+        } break;
+        case Token_OpMin: {
+          Number *operandB = &resultStack[(resultStackCount - 1) * BATCH_LANE_COUNT];
+          Number *operandA = &resultStack[(resultStackCount - 2) * BATCH_LANE_COUNT];
+          for (size_t lane = 0; lane < laneCount; lane++) {
+            operandA[lane] = (operandA[lane] < operandB[lane]) ? operandA[lane] : operandB[lane];
+          }
+          resultStackCount--;
+        } break;
+
+        case Token_IfThen: {
+          Number *condition = &resultStack[(resultStackCount - 1) * BATCH_LANE_COUNT];
+          size_t takenCount = 0;
+          for (size_t lane = 0; lane < laneCount; lane++) {
+            takenCount += (condition[lane] != zero);
+          }
+
+          if (takenCount == laneCount) {
+            resultStackCount--;
+            isBranchMixedStack[branchCount] = 0;
+          }
+          else if (takenCount == 0) {
+            resultStackCount--;
+            isBranchMixedStack[branchCount] = 0;
+            codeIndex = instruction.operand;
+          }
+          else {
+            // NOTE(Hakan): Keep the condition around for the select in OpIf
+            isBranchMixedStack[branchCount] = 1;
+          }
+          branchCount++;
+        } break;
+        case Token_IfElse: {
+          if (!isBranchMixedStack[branchCount - 1]) {
+            branchCount--;
+            codeIndex = instruction.operand;
+          }
+        } break;
+        case Token_OpIf: {
+          branchCount--;
+          if (isBranchMixedStack[branchCount]) {
+            Number *operandB = &resultStack[(resultStackCount - 1) * BATCH_LANE_COUNT];
+            Number *operandA = &resultStack[(resultStackCount - 2) * BATCH_LANE_COUNT];
+            Number *condition = &resultStack[(resultStackCount - 3) * BATCH_LANE_COUNT];
+            for (size_t lane = 0; lane < laneCount; lane++) {
+              condition[lane] = (condition[lane] != zero) ? operandA[lane] : operandB[lane];
+            }
+            resultStackCount -= 2;
+          }
+        } break;
+
+        case Token_Function: {
+          Function *function = &program->functions->functions[instruction.operand];
+          Number *arguments[FUNCTION_MAX_ARGUMENTS];
+          for (size_t argumentIndex = 0; argumentIndex < function->argumentCount; argumentIndex++) {
+            arguments[argumentIndex] = &resultStack[(resultStackCount - function->argumentCount + argumentIndex) * BATCH_LANE_COUNT];
+          }
+
+          ((NativeFunction<Number>)function->callback)(arguments, functionResults, laneCount, function->userData);
+          resultStackCount -= function->argumentCount;
+          memcpy(&resultStack[resultStackCount * BATCH_LANE_COUNT], functionResults, sizeof(Number) * laneCount);
+          resultStackCount++;
+        } break;
+
+        case Token_Number: {
+          Number *operand = &resultStack[resultStackCount * BATCH_LANE_COUNT];
+          Number constant = constants[instruction.operand];
+          for (size_t lane = 0; lane < laneCount; lane++) {
+            operand[lane] = constant;
+          }
+          resultStackCount++;
+        } break;
+        case Token_Identifier: {
+          Number *operand = &resultStack[resultStackCount * BATCH_LANE_COUNT];
+          memcpy(operand, variables[instruction.operand] + rowIndex, sizeof(Number) * laneCount);
+          resultStackCount++;
+        } break;
+        case Token_StoreLocal: {
+          resultStackCount--;
+          memcpy(&locals[instruction.operand * BATCH_LANE_COUNT], &resultStack[resultStackCount * BATCH_LANE_COUNT],
+                 sizeof(Number) * laneCount);
+        } break;
+        case Token_LoadLocal: {
+          memcpy(&resultStack[resultStackCount * BATCH_LANE_COUNT], &locals[instruction.operand * BATCH_LANE_COUNT],
+                 sizeof(Number) * laneCount);
+          resultStackCount++;
+        } break;
+      }
+    }
+
+    ASSERT(resultStackCount == 1);
+    memcpy(results + rowIndex, resultStack, sizeof(Number) * laneCount);
+  }
+
+  free(resultStack);
+}
+
+// NOTE(Hakan): Evaluates to zero when the expression doesn't compile,
+// tokenizer->error says why
+template <typename Number = r64>
+Number evalExpression(Tokenizer *tokenizer) {
+  Program program;
+  if (!compileExpression<Number>(tokenizer, &program)) {
+    return numberFromBool<Number>(0);
+  }
+
+  // NOTE(Hakan): Variables that are never assigned evaluate to zero
+  Number *variables = (Number*)calloc(program.variableCount + 1, sizeof(Number));
+
+  Number result = evalProgram(&program, variables);
+  free(variables);
+  freeProgram(&program);
+  return result;
+}
+
+// NOTE(Hakan): Dispatch for callers that only know the numeric type at runtime
+bool32 compileProgramOfType(NumberType type, ListOfTokens *rtn, Program *program, char *error) {
+  switch (type) {
+    case NumberType_R32: return compileProgram<r32>(rtn, program, error);
+    case NumberType_Fixed64: return compileProgram<Fixed64>(rtn, program, error);
+    default: return compileProgram<r64>(rtn, program, error);
+  }
+}
+
+bool32 compileExpressionOfType(NumberType type, Tokenizer *tokenizer, Program *program) {
+  switch (type) {
+    case NumberType_R32: return compileExpression<r32>(tokenizer, program);
+    case NumberType_Fixed64: return compileExpression<Fixed64>(tokenizer, program);
+    default: return compileExpression<r64>(tokenizer, program);
+  }
+}
+
+template <typename Number>
+static r64 evalProgramAsR64(Program *program) {
+  // NOTE(Hakan): Variables that are never assigned evaluate to zero
+  Number *variables = (Number*)calloc(program->variableCount + 1, sizeof(Number));
+
+  r64 result = numberToR64(evalProgram(program, variables));
+  free(variables);
+  return result;
+}
+
+r64 evalProgramOfType(Program *program) {
+  switch (program->numberType) {
+    case NumberType_R32: return evalProgramAsR64<r32>(program);
+    case NumberType_Fixed64: return evalProgramAsR64<Fixed64>(program);
+    default: return evalProgramAsR64<r64>(program);
+  }
+}
+
+// NOTE(Hakan): Program image layout, all integers in host byte order:
+//
+//   ProgramImageHeader
+//   ProgramImageEntry[programCount]
+//   program records, each 8 byte aligned:
+//     constants[constantCount], each getNumberTypeSize(numberType) bytes
+//     Instruction code[codeCount]
+//     u32 variableNameOffsets[variableCount]
+//     char variableNames[variableNamesSize]
+//
+// The header checksums the entry table and every entry checksums its own
+// record, so mapping an image is O(1) and a program is only verified the first
+// time it is looked up with getImageProgram(). Verifying checks the record
+// against its checksum and runs measureProgram() over its code, which has to
+// come out with the sizes the entry claims.
+#define PROGRAM_IMAGE_MAGIC 0x434c4143 // "CALC"
+#define PROGRAM_IMAGE_VERSION 5
+#define PROGRAM_IMAGE_ALIGNMENT 8
+
+struct ProgramImageHeader {
+  u32 magic;
+  u32 version;
+  // NOTE(Hakan): Instruction types are TokenType values, see
+  // getInstructionSetChecksum()
+  u32 instructionSetChecksum;
+  u32 programCount;
+  u64 imageSize;
+  u32 entriesChecksum;
+  u32 reserved;
+};
+
+struct ProgramImageEntry {
+  u64 offset;
+  u32 numberType;
+  u32 branchDepth;
+  u32 constantCount;
+  u32 codeCount;
+  u32 variableCount;
+  u32 variableNamesSize;
+  u32 stackSize;
+  u32 checksum;
+  u32 localCount;
+  u32 reserved;
+};
+
+struct ProgramImage {
+  char *memory;
+  size_t size;
+
+  ProgramImageHeader *header;
+  ProgramImageEntry *entries;
+  size_t programCount;
+
+  // NOTE(Hakan): One bit per program that is set once it has been verified
+  u32 *isVerified;
+
+#ifdef _WIN32
+  Win32Handle file;
+  Win32Handle mapping;
+#endif
+};
+
+// NOTE(Hakan): Covers the name and argument count of every operator in the
+// order of the enumeration and the values of the other instruction types, so
+// an image written before TokenType was reordered or extended is rejected even
+// if PROGRAM_IMAGE_VERSION wasn't bumped
+static u32 getInstructionSetChecksum() {
+  char text[1024];
+  size_t textLength = 0;
+  for (size_t operatorIndex = 0; operatorIndex < ArrayCount(operatorLookup); operatorIndex++) {
+    textLength += snprintf(text + textLength, sizeof(text) - textLength, "%s%zu,",
+                           operatorLookup[operatorIndex].name, operatorLookup[operatorIndex].argumentCount);
+  }
+  textLength += snprintf(text + textLength, sizeof(text) - textLength, "%d,%d,%d,%d,%d,%d,%d,%d",
+                         Token_OpStart, Token_OpEnd, Token_IfThen, Token_IfElse,
+                         Token_Number, Token_Identifier, Token_StoreLocal, Token_LoadLocal);
+  ASSERT(textLength < sizeof(text));
+
+  return checksum32(text, textLength);
+}
+
+static inline size_t alignSize(size_t size, size_t alignment) {
+  return (size + alignment - 1) & ~(alignment - 1);
+}
+
+static size_t getProgramRecordSize(Program *program) {
+  size_t result = (getNumberTypeSize(program->numberType) * program->constantCount +
+                   sizeof(Instruction) * program->codeCount +
+                   sizeof(u32) * program->variableCount +
+                   program->variableNamesSize);
+  return alignSize(result, PROGRAM_IMAGE_ALIGNMENT);
+}
+
+size_t getProgramImageSize(Program *programs, size_t programCount) {
+  size_t result = sizeof(ProgramImageHeader) + sizeof(ProgramImageEntry) * programCount;
+  for (size_t programIndex = 0; programIndex < programCount; programIndex++) {
+    result += getProgramRecordSize(&programs[programIndex]);
+  }
+
+  return result;
+}
+
+// NOTE(Hakan): Returns the number of bytes written or 0 if memory is too small
+// or a program calls native functions, which can't be stored in an image
+size_t writeProgramImage(Program *programs, size_t programCount, void *memory, size_t memorySize) {
+  size_t imageSize = getProgramImageSize(programs, programCount);
+  if (imageSize > memorySize) {
+    return 0;
+  }
+
+  for (size_t programIndex = 0; programIndex < programCount; programIndex++) {
+    Program *program = &programs[programIndex];
+    for (size_t codeIndex = 0; codeIndex < program->codeCount; codeIndex++) {
+      if (program->code[codeIndex].type == Token_Function) {
+        return 0;
+      }
+    }
+  }
+
+  char *image = (char*)memory;
+  ProgramImageHeader *header = (ProgramImageHeader*)image;
+  ProgramImageEntry *entries = (ProgramImageEntry*)(header + 1);
+  size_t offset = sizeof(ProgramImageHeader) + sizeof(ProgramImageEntry) * programCount;
+
+  for (size_t programIndex = 0; programIndex < programCount; programIndex++) {
+    Program *program = &programs[programIndex];
+    ProgramImageEntry *entry = &entries[programIndex];
+    size_t recordSize = getProgramRecordSize(program);
+    char *at = image + offset;
+
+    memset(at, 0, recordSize);
+    // NOTE(Hakan): Programs of variables alone have no constants array
+    size_t constantsSize = getNumberTypeSize(program->numberType) * program->constantCount;
+    if (constantsSize > 0) {
+      memcpy(at, program->constants, constantsSize);
+      at += constantsSize;
+    }
+    memcpy(at, program->code, sizeof(Instruction) * program->codeCount);
+    at += sizeof(Instruction) * program->codeCount;
+    // NOTE(Hakan): Programs without variables have no variable arrays at all
+    if (program->variableCount > 0) {
+      memcpy(at, program->variableNameOffsets, sizeof(u32) * program->variableCount);
+      at += sizeof(u32) * program->variableCount;
+      memcpy(at, program->variableNames, program->variableNamesSize);
+    }
+
+    entry->offset = offset;
+    entry->numberType = program->numberType;
+    entry->branchDepth = (u32)program->branchDepth;
+    entry->constantCount = (u32)program->constantCount;
+    entry->codeCount = (u32)program->codeCount;
+    entry->variableCount = (u32)program->variableCount;
+    entry->variableNamesSize = (u32)program->variableNamesSize;
+    entry->stackSize = (u32)program->stackSize;
+    entry->localCount = (u32)program->localCount;
+    entry->reserved = 0;
+    entry->checksum = checksum32(image + offset, recordSize);
+
+    offset += recordSize;
+  }
+  ASSERT(offset == imageSize);
+
+  header->magic = PROGRAM_IMAGE_MAGIC;
+  header->version = PROGRAM_IMAGE_VERSION;
+  header->instructionSetChecksum = getInstructionSetChecksum();
+  header->programCount = (u32)programCount;
+  header->imageSize = imageSize;
+  header->entriesChecksum = checksum32(entries, sizeof(ProgramImageEntry) * programCount);
+  header->reserved = 0;
+
+  return imageSize;
+}
+
+bool32 writeProgramImageFile(const char *path, Program *programs, size_t programCount) {
+  size_t imageSize = getProgramImageSize(programs, programCount);
+  void *image = malloc(imageSize);
+
+  bool32 result = 0;
+  FILE *file = 0;
+  if (writeProgramImage(programs, programCount, image, imageSize)) {
+    file = fopen(path, "wb");
+  }
+  if (file) {
+    result = (bool32)(fwrite(image, 1, imageSize, file) == imageSize);
+    result &= (bool32)(fclose(file) == 0);
+  }
+
+  free(image);
+  return result;
+}
+
+bool32 openProgramImage(ProgramImage *image, void *memory, size_t size) {
+  ProgramImageHeader *header = (ProgramImageHeader*)memory;
+  if ((size < sizeof(ProgramImageHeader)) ||
+      (header->magic != PROGRAM_IMAGE_MAGIC) ||
+      (header->version != PROGRAM_IMAGE_VERSION) ||
+      (header->instructionSetChecksum != getInstructionSetChecksum()) ||
+      (header->imageSize != size) ||
+      ((size - sizeof(ProgramImageHeader)) / sizeof(ProgramImageEntry) < header->programCount)) {
+    return 0;
+  }
+
+  ProgramImageEntry *entries = (ProgramImageEntry*)(header + 1);
+  if (checksum32(entries, sizeof(ProgramImageEntry) * header->programCount) != header->entriesChecksum) {
+    return 0;
+  }
+
+  image->memory = (char*)memory;
+  image->size = size;
+  image->header = header;
+  image->entries = entries;
+  image->programCount = header->programCount;
+  image->isVerified = (u32*)calloc((image->programCount + 31) / 32 + 1, sizeof(u32));
+
+  return 1;
+}
+
+// NOTE(Hakan): Frees what openProgramImage() allocated, the memory of the
+// image belongs to the caller
+void closeProgramImage(ProgramImage *image) {
+  free(image->isVerified);
+  image->isVerified = 0;
+}
+
+// NOTE(Hakan): The returned program points straight into the image and must
+// not be passed to freeProgram()
+bool32 getImageProgram(ProgramImage *image, size_t programIndex, Program *program) {
+  if (programIndex >= image->programCount) {
+    return 0;
+  }
+
+  ProgramImageEntry *entry = &image->entries[programIndex];
+  if (entry->numberType >= NumberTypes_Count) {
+    return 0;
+  }
+
+  Program result = {};
+  result.numberType = (NumberType)entry->numberType;
+  result.constantCount = entry->constantCount;
+  result.codeCount = entry->codeCount;
+  result.variableCount = entry->variableCount;
+  result.variableNamesSize = entry->variableNamesSize;
+  result.stackSize = entry->stackSize;
+  result.branchDepth = entry->branchDepth;
+  result.localCount = entry->localCount;
+
+  size_t recordSize = getProgramRecordSize(&result);
+  if ((entry->offset % PROGRAM_IMAGE_ALIGNMENT != 0) ||
+      (entry->offset > image->size) ||
+      (recordSize > image->size - entry->offset)) {
+    return 0;
+  }
+
+  char *at = image->memory + entry->offset;
+  result.constants = at;
+  at += getNumberTypeSize(result.numberType) * result.constantCount;
+  result.code = (Instruction*)at;
+  at += sizeof(Instruction) * result.codeCount;
+  result.variableNameOffsets = (u32*)at;
+  at += sizeof(u32) * result.variableCount;
+  result.variableNames = at;
+
+  u32 verifiedBit = (u32)1 << (programIndex % 32);
+  if (!(image->isVerified[programIndex / 32] & verifiedBit)) {
+    if (checksum32(image->memory + entry->offset, recordSize) != entry->checksum) {
+      return 0;
+    }
+
+    // NOTE(Hakan): The checksum only proves the record is what was written,
+    // not that a program the evaluators can run safely was written
+    size_t stackSize, branchDepth, localCount;
+    if (!measureProgram(&result, &stackSize, &branchDepth, &localCount) ||
+        (stackSize != result.stackSize) || (branchDepth != result.branchDepth) ||
+        (localCount != result.localCount)) {
+      return 0;
+    }
+
+    if ((result.variableCount > 0) &&
+        ((result.variableNamesSize == 0) || (result.variableNames[result.variableNamesSize - 1] != '\0'))) {
+      return 0;
+    }
+    for (size_t variableIndex = 0; variableIndex < result.variableCount; variableIndex++) {
+      if (result.variableNameOffsets[variableIndex] >= result.variableNamesSize) {
+        return 0;
+      }
+    }
+
+    image->isVerified[programIndex / 32] |= verifiedBit;
+  }
+
+  *program = result;
+  return 1;
+}
+
+bool32 mapProgramImageFile(ProgramImage *image, const char *path) {
+  *image = {};
+
+#ifdef _WIN32
+  Win32Handle file = CreateFileA(path, WIN32_GENERIC_READ, WIN32_FILE_SHARE_READ, 0, WIN32_OPEN_EXISTING,
+                                 WIN32_FILE_ATTRIBUTE_NORMAL, 0);
+  if (file == WIN32_INVALID_HANDLE_VALUE) {
+    return 0;
+  }
+
+  long long fileSize = 0;
+  Win32Handle mapping = 0;
+  void *memory = 0;
+  if (GetFileSizeEx(file, &fileSize) && (fileSize > 0)) {
+    mapping = CreateFileMappingA(file, 0, WIN32_PAGE_READONLY, 0, 0, 0);
+    if (mapping) {
+      memory = MapViewOfFile(mapping, WIN32_FILE_MAP_READ, 0, 0, 0);
+    }
+  }
+
+  if (memory && openProgramImage(image, memory, (size_t)fileSize)) {
+    image->file = file;
+    image->mapping = mapping;
+    return 1;
+  }
+
+  if (memory) {
+    UnmapViewOfFile(memory);
+  }
+  if (mapping) {
+    CloseHandle(mapping);
+  }
+  CloseHandle(file);
+  return 0;
+#else
+  int file = open(path, O_RDONLY);
+  if (file < 0) {
+    return 0;
+  }
+
+  struct stat fileStat;
+  void *memory = MAP_FAILED;
+  if ((fstat(file, &fileStat) == 0) && (fileStat.st_size > 0)) {
+    memory = mmap(0, (size_t)fileStat.st_size, PROT_READ, MAP_SHARED, file, 0);
+  }
+  // NOTE(Hakan): The mapping stays valid after the descriptor is closed
+  close(file);
+
+  if (memory == MAP_FAILED) {
+    return 0;
+  }
+
+  if (!openProgramImage(image, memory, (size_t)fileStat.st_size)) {
+    munmap(memory, (size_t)fileStat.st_size);
+    return 0;
+  }
+
+  return 1;
+#endif
+}
+
+void unmapProgramImageFile(ProgramImage *image) {
+  closeProgramImage(image);
+#ifdef _WIN32
+  UnmapViewOfFile(image->memory);
+  CloseHandle(image->mapping);
+  CloseHandle(image->file);
+#else
+  munmap(image->memory, image->size);
+#endif
+  *image = {};
+}
+
+#ifndef TEST
+int main(int numArguments, char** arguments) {
+  if (numArguments < 2) {
+    printf("Usage: calc.exe [-t r64|r32|fixed64] [-d \"f(x) = expr\"]... expr\n");
+    printf("       calc.exe [-t r64|r32|fixed64] [-d \"f(x) = expr\"]... -o image expr...\n");
+    printf("       calc.exe [-t r64|r32|fixed64] [-d \"f(x) = expr\"]... -f file|-\n");
+    printf("       calc.exe -m image [programIndex]");
+    return 0;
+  }
+
+  NumberType numberType = NumberType_R64;
+  if ((strcmp(arguments[1], "-t") == 0) && (numArguments > 3)) {
+    numberType = NumberTypes_Count;
+    for (int typeIndex = 0; typeIndex < NumberTypes_Count; typeIndex++) {
+      if (strcmp(arguments[2], getNumberTypeName((NumberType)typeIndex)) == 0) {
+        numberType = (NumberType)typeIndex;
+      }
+    }
+
+    if (numberType == NumberTypes_Count) {
+      printf("Unknown number type %s\n", arguments[2]);
+      return 1;
+    }
+
+    arguments += 2;
+    numArguments -= 2;
+  }
+
+  FunctionTable functions = {};
+  while ((strcmp(arguments[1], "-d") == 0) && (numArguments > 3)) {
+    if (!defineFunction(&functions, arguments[2])) {
+      printf("Invalid function definition %s\n", arguments[2]);
+      return 1;
+    }
+
+    arguments += 2;
+    numArguments -= 2;
+  }
+
+  // NOTE(Hakan): Compile every expression into a program image
+  if ((strcmp(arguments[1], "-o") == 0) && (numArguments > 3)) {
+    size_t programCount = numArguments - 3;
+    Program *programs = (Program*)calloc(programCount, sizeof(Program));
+    bool32 isCompiled = 1;
+    for (size_t programIndex = 0; isCompiled && (programIndex < programCount); programIndex++) {
+      Tokenizer tokenizer = {};
+      tokenizer.at = arguments[programIndex + 3];
+      tokenizer.functions = &functions;
+
+      isCompiled = compileExpressionOfType(numberType, &tokenizer, &programs[programIndex]);
+      if (!isCompiled) {
+        printf("%s in %s\n", tokenizer.error, arguments[programIndex + 3]);
+      }
+    }
+
+    bool32 isWritten = (bool32)(isCompiled && writeProgramImageFile(arguments[2], programs, programCount));
+    if (isCompiled && !isWritten) {
+      printf("Failed to write program image %s\n", arguments[2]);
+    }
+
+    for (size_t programIndex = 0; programIndex < programCount; programIndex++) {
+      freeProgram(&programs[programIndex]);
+    }
+    free(programs);
+    freeFunctionTable(&functions);
+    return isWritten ? 0 : 1;
+  }
+
+  // NOTE(Hakan): Evaluate a program straight out of a mapped program image
+  if ((strcmp(arguments[1], "-m") == 0) && (numArguments > 2)) {
+    ProgramImage image;
+    if (!mapProgramImageFile(&image, arguments[2])) {
+      printf("Failed to map program image %s\n", arguments[2]);
+      return 1;
+    }
+
+    size_t programIndex = (numArguments > 3) ? (size_t)atoi(arguments[3]) : 0;
+    Program program;
+    if (!getImageProgram(&image, programIndex, &program)) {
+      printf("Program %zu is missing or corrupt in %s\n", programIndex, arguments[2]);
+      unmapProgramImageFile(&image);
+      return 1;
+    }
+
+    printf("%f\n", evalProgramOfType(&program));
+
+    unmapProgramImageFile(&image);
+    return 0;
+  }
+
+  // NOTE(Hakan): Stream the expression from a file or stdin, it never has to
+  // fit in memory as text
+  if ((strcmp(arguments[1], "-f") == 0) && (numArguments > 2)) {
+#ifdef _WIN32
+    int file = (strcmp(arguments[2], "-") == 0) ? 0 : _open(arguments[2], _O_RDONLY | _O_BINARY);
+#else
+    int file = (strcmp(arguments[2], "-") == 0) ? 0 : open(arguments[2], O_RDONLY);
+#endif
+    if (file < 0) {
+      printf("Failed to open %s\n", arguments[2]);
+      return 1;
+    }
+
+    Tokenizer tokenizer = {};
+    tokenizer.functions = &functions;
+    beginTokenizerStream(&tokenizer, readFileDescriptor, &file);
+    Program program;
+    bool32 isCompiled = compileExpressionOfType(numberType, &tokenizer, &program);
+    endTokenizerStream(&tokenizer);
+#ifdef _WIN32
+    _close(file);
+#else
+    close(file);
+#endif
+
+    if (!isCompiled) {
+      printf("%s\n", tokenizer.error);
+      freeFunctionTable(&functions);
+      return 1;
+    }
+
+    printf("%f\n", evalProgramOfType(&program));
+    freeProgram(&program);
+    freeFunctionTable(&functions);
+    return 0;
+  }
+
+  const char *expr = arguments[numArguments - 1];
+
+  Tokenizer tokenizer = {};
+  tokenizer.at = const_cast<char*>(expr);
+  tokenizer.functions = &functions;
+
+  Program program;
+  if (!compileExpressionOfType(numberType, &tokenizer, &program)) {
+    printf("%s\n", tokenizer.error);
+    freeFunctionTable(&functions);
+    return 1;
+  }
 
-  r64 result = evalExpression(&tokenizer);
-  printf("%f\n", result);
+  printf("%f\n", evalProgramOfType(&program));
+  freeProgram(&program);
+  freeFunctionTable(&functions);
 
   return 0;
 }
@@ -0,0 +1,335 @@
+#ifndef NUMBER_HEADER_INCLUDED_H
+#define NUMBER_HEADER_INCLUDED_H
+
+// NOTE(Hakan): The numeric types a program can be compiled for. Everything
+// the evaluator needs from a type is the arithmetic operators, the comparison
+// operators and the number* functions below, so adding a back end means
+// adding one overload of each.
+enum NumberType {
+  NumberType_R64,
+  NumberType_R32,
+  NumberType_Fixed64,
+
+  NumberTypes_Count,
+};
+
+static const unsigned long long powersOf10[] = {
+  1, 10, 100,
+  1000, 10000, 100000,
+  1000000, 10000000, 100000000,
+  1000000000, 10000000000, 100000000000,
+  1000000000000, 10000000000000, 100000000000000,
+  1000000000000000, 10000000000000000, 100000000000000000,
+  1000000000000000000, 10000000000000000000ULL,
+};
+
+//
+// NOTE(Hakan): Fixed64 is a signed Q31.32 fixed point number. Every operation
+// is done with integer instructions so results are bit identical on every
+// machine. There is no NaN or infinity: division by zero saturates, overflow
+// wraps around and a negative number raised to a fractional power is zero.
+//
+#define FIXED64_FRACTION_BITS 32
+#define FIXED64_ONE ((int64_t)1 << FIXED64_FRACTION_BITS)
+#define FIXED64_PI ((int64_t)13493037705)      // pi * 2^32
+#define FIXED64_HALF_PI ((int64_t)6746518852)  // pi/2 * 2^32
+#define FIXED64_TWO_PI ((int64_t)26986075409)  // 2pi * 2^32
+#define FIXED64_LN2 ((int64_t)2977044472)      // ln(2) * 2^32
+
+struct Fixed64 {
+  int64_t value;
+};
+
+static inline Fixed64 fixed64(int64_t value) {
+  Fixed64 result;
+  result.value = value;
+  return result;
+}
+
+// NOTE(Hakan): Full 128 bit product of two unsigned 64 bit numbers
+static inline void multiplyU64(u64 a, u64 b, u64 *high, u64 *low) {
+  u64 aLow = a & 0xffffffff;
+  u64 aHigh = a >> 32;
+  u64 bLow = b & 0xffffffff;
+  u64 bHigh = b >> 32;
+
+  u64 lowLow = aLow * bLow;
+  u64 lowHigh = aLow * bHigh;
+  u64 highLow = aHigh * bLow;
+  u64 highHigh = aHigh * bHigh;
+
+  u64 middle = (lowLow >> 32) + (lowHigh & 0xffffffff) + (highLow & 0xffffffff);
+  *low = (middle << 32) | (lowLow & 0xffffffff);
+  *high = highHigh + (lowHigh >> 32) + (highLow >> 32) + (middle >> 32);
+}
+
+// NOTE(Hakan): Low 64 bits of the quotient of a 128 bit dividend, rounded to
+// nearest. divisor must be non-zero and at most 2^63.
+static inline u64 divideU128(u64 high, u64 low, u64 divisor) {
+  u64 quotient = 0;
+  u64 remainder = 0;
+  for (int bitIndex = 127; bitIndex >= 0; bitIndex--) {
+    u64 bit = (bitIndex >= 64) ? ((high >> (bitIndex - 64)) & 1) : ((low >> bitIndex) & 1);
+    remainder = (remainder << 1) | bit;
+    quotient <<= 1;
+    if (remainder >= divisor) {
+      remainder -= divisor;
+      quotient |= 1;
+    }
+  }
+
+  if (remainder >= divisor - remainder) {
+    quotient++;
+  }
+
+  return quotient;
+}
+
+static inline Fixed64 operator+(Fixed64 a, Fixed64 b) {
+  return fixed64((int64_t)((u64)a.value + (u64)b.value));
+}
+
+static inline Fixed64 operator-(Fixed64 a, Fixed64 b) {
+  return fixed64((int64_t)((u64)a.value - (u64)b.value));
+}
+
+static inline Fixed64 operator-(Fixed64 a) {
+  return fixed64((int64_t)(0 - (u64)a.value));
+}
+
+static inline Fixed64 operator*(Fixed64 a, Fixed64 b) {
+  bool32 isNegative = (bool32)((a.value < 0) != (b.value < 0));
+  u64 magnitudeA = (a.value < 0) ? (0 - (u64)a.value) : (u64)a.value;
+  u64 magnitudeB = (b.value < 0) ? (0 - (u64)b.value) : (u64)b.value;
+
+  u64 high, low;
+  multiplyU64(magnitudeA, magnitudeB, &high, &low);
+
+  // NOTE(Hakan): Round to nearest before dropping the fraction bits
+  u64 roundedLow = low + ((u64)1 << (FIXED64_FRACTION_BITS - 1));
+  high += (roundedLow < low);
+  u64 magnitude = (high << (64 - FIXED64_FRACTION_BITS)) | (roundedLow >> FIXED64_FRACTION_BITS);
+
+  return fixed64((int64_t)(isNegative ? (0 - magnitude) : magnitude));
+}
+
+static inline Fixed64 operator/(Fixed64 a, Fixed64 b) {
+  if (b.value == 0) {
+    if (a.value == 0) {
+      return fixed64(0);
+    }
+    return fixed64((a.value > 0) ? INT64_MAX : INT64_MIN);
+  }
+
+  bool32 isNegative = (bool32)((a.value < 0) != (b.value < 0));
+  u64 magnitudeA = (a.value < 0) ? (0 - (u64)a.value) : (u64)a.value;
+  u64 magnitudeB = (b.value < 0) ? (0 - (u64)b.value) : (u64)b.value;
+
+  u64 magnitude = divideU128(magnitudeA >> (64 - FIXED64_FRACTION_BITS),
+                             magnitudeA << FIXED64_FRACTION_BITS,
+                             magnitudeB);
+
+  return fixed64((int64_t)(isNegative ? (0 - magnitude) : magnitude));
+}
+
+static inline bool32 operator<(Fixed64 a, Fixed64 b) { return (bool32)(a.value < b.value); }
+static inline bool32 operator>(Fixed64 a, Fixed64 b) { return (bool32)(a.value > b.value); }
+static inline bool32 operator<=(Fixed64 a, Fixed64 b) { return (bool32)(a.value <= b.value); }
+static inline bool32 operator>=(Fixed64 a, Fixed64 b) { return (bool32)(a.value >= b.value); }
+static inline bool32 operator==(Fixed64 a, Fixed64 b) { return (bool32)(a.value == b.value); }
+static inline bool32 operator!=(Fixed64 a, Fixed64 b) { return (bool32)(a.value != b.value); }
+
+static Fixed64 fixed64Sin(Fixed64 x) {
+  // NOTE(Hakan): Reduce to [-pi, pi] and then to [-pi/2, pi/2] using
+  // sin(pi - x) = sin(x)
+  int64_t angle = x.value % FIXED64_TWO_PI;
+  if (angle > FIXED64_PI) {
+    angle -= FIXED64_TWO_PI;
+  }
+  else if (angle < -FIXED64_PI) {
+    angle += FIXED64_TWO_PI;
+  }
+
+  if (angle > FIXED64_HALF_PI) {
+    angle = FIXED64_PI - angle;
+  }
+  else if (angle < -FIXED64_HALF_PI) {
+    angle = -FIXED64_PI - angle;
+  }
+
+  // NOTE(Hakan): Taylor series up to x^15 in Horner form, the first dropped
+  // term is below 2^-32 on [-pi/2, pi/2]
+  Fixed64 reduced = fixed64(angle);
+  Fixed64 squared = reduced * reduced;
+  Fixed64 result = fixed64(FIXED64_ONE);
+  for (int64_t n = 15; n > 1; n -= 2) {
+    Fixed64 term = squared * result;
+    result = fixed64(FIXED64_ONE - term.value / (n * (n - 1)));
+  }
+
+  return reduced * result;
+}
+
+static Fixed64 fixed64Log2(Fixed64 x) {
+  ASSERT(x.value > 0);
+
+  int msbIndex = 63;
+  while (((u64)x.value >> msbIndex) == 0) {
+    msbIndex--;
+  }
+
+  // NOTE(Hakan): Normalize to [1, 2) and produce one fraction bit per squaring
+  u64 normalized = (msbIndex >= FIXED64_FRACTION_BITS)
+    ? ((u64)x.value >> (msbIndex - FIXED64_FRACTION_BITS))
+    : ((u64)x.value << (FIXED64_FRACTION_BITS - msbIndex));
+
+  int64_t result = (int64_t)(msbIndex - FIXED64_FRACTION_BITS) * FIXED64_ONE;
+  for (int bitIndex = FIXED64_FRACTION_BITS - 1; bitIndex >= 0; bitIndex--) {
+    u64 high, low;
+    multiplyU64(normalized, normalized, &high, &low);
+    normalized = (high << (64 - FIXED64_FRACTION_BITS)) | (low >> FIXED64_FRACTION_BITS);
+    if (normalized >= ((u64)2 << FIXED64_FRACTION_BITS)) {
+      normalized >>= 1;
+      result |= (int64_t)1 << bitIndex;
+    }
+  }
+
+  return fixed64(result);
+}
+
+static Fixed64 fixed64Exp2(Fixed64 x) {
+  int64_t integerPart = x.value >> FIXED64_FRACTION_BITS;
+  if (integerPart >= 63 - FIXED64_FRACTION_BITS) {
+    return fixed64(INT64_MAX);
+  }
+  if (integerPart < -FIXED64_FRACTION_BITS) {
+    return fixed64(0);
+  }
+
+  // NOTE(Hakan): 2^f = e^(f ln2) for the fraction f in [0, 1), Taylor series
+  // up to the 13th power
+  Fixed64 exponent = fixed64(x.value - integerPart * FIXED64_ONE) * fixed64(FIXED64_LN2);
+  Fixed64 result = fixed64(FIXED64_ONE);
+  for (int64_t n = 13; n >= 1; n--) {
+    Fixed64 term = exponent * result;
+    result = fixed64(FIXED64_ONE + term.value / n);
+  }
+
+  if (integerPart >= 0) {
+    return fixed64(result.value << integerPart);
+  }
+  return fixed64(result.value >> -integerPart);
+}
+
+//
+// NOTE(Hakan): Per type math functions used by the evaluator
+//
+static inline r64 numberSin(r64 x) { return sin(x); }
+static inline r64 numberCos(r64 x) { return cos(x); }
+static inline r64 numberTan(r64 x) { return tan(x); }
+static inline r64 numberPow(r64 x, r64 y) { return pow(x, y); }
+
+static inline r32 numberSin(r32 x) { return sinf(x); }
+static inline r32 numberCos(r32 x) { return cosf(x); }
+static inline r32 numberTan(r32 x) { return tanf(x); }
+static inline r32 numberPow(r32 x, r32 y) { return powf(x, y); }
+
+static inline Fixed64 numberSin(Fixed64 x) { return fixed64Sin(x); }
+static inline Fixed64 numberCos(Fixed64 x) { return fixed64Sin(x + fixed64(FIXED64_HALF_PI)); }
+static inline Fixed64 numberTan(Fixed64 x) { return numberSin(x) / numberCos(x); }
+
+static Fixed64 numberPow(Fixed64 x, Fixed64 y) {
+  // NOTE(Hakan): Integer exponents are exact and allow negative bases
+  if ((y.value & (FIXED64_ONE - 1)) == 0) {
+    int64_t exponent = y.value >> FIXED64_FRACTION_BITS;
+    u64 exponentMagnitude = (exponent < 0) ? (0 - (u64)exponent) : (u64)exponent;
+
+    Fixed64 result = fixed64(FIXED64_ONE);
+    Fixed64 base = x;
+    while (exponentMagnitude) {
+      if (exponentMagnitude & 1) {
+        result = result * base;
+      }
+      base = base * base;
+      exponentMagnitude >>= 1;
+    }
+
+    return (exponent < 0) ? (fixed64(FIXED64_ONE) / result) : result;
+  }
+
+  if (x.value <= 0) {
+    return fixed64(0);
+  }
+
+  return fixed64Exp2(y * fixed64Log2(x));
+}
+
+template <typename Number> static inline NumberType getNumberType();
+template <> inline NumberType getNumberType<r64>() { return NumberType_R64; }
+template <> inline NumberType getNumberType<r32>() { return NumberType_R32; }
+template <> inline NumberType getNumberType<Fixed64>() { return NumberType_Fixed64; }
+
+static inline size_t getNumberTypeSize(NumberType type) {
+  switch (type) {
+    case NumberType_R64: return sizeof(r64);
+    case NumberType_R32: return sizeof(r32);
+    case NumberType_Fixed64: return sizeof(Fixed64);
+    default: return 0;
+  }
+}
+
+static inline const char *getNumberTypeName(NumberType type) {
+  switch (type) {
+    case NumberType_R64: return "r64";
+    case NumberType_R32: return "r32";
+    case NumberType_Fixed64: return "fixed64";
+    default: return "unknown";
+  }
+}
+
+// NOTE(Hakan): Converts mantisa / 10^numDigitsAfterDecimalPoint
+template <typename Number> static inline Number numberFromDecimal(unsigned long long mantisa, size_t numDigitsAfterDecimalPoint);
+
+template <> inline r64 numberFromDecimal<r64>(unsigned long long mantisa, size_t numDigitsAfterDecimalPoint) {
+  return (r64)mantisa / (r64)powersOf10[numDigitsAfterDecimalPoint];
+}
+
+template <> inline r32 numberFromDecimal<r32>(unsigned long long mantisa, size_t numDigitsAfterDecimalPoint) {
+  return (r32)numberFromDecimal<r64>(mantisa, numDigitsAfterDecimalPoint);
+}
+
+template <> inline Fixed64 numberFromDecimal<Fixed64>(unsigned long long mantisa, size_t numDigitsAfterDecimalPoint) {
+  // NOTE(Hakan): Digits past the 18th are far below the 2^-32 resolution,
+  // dropping them keeps the divisor within the 2^63 divideU128() takes
+  while (numDigitsAfterDecimalPoint > 18) {
+    mantisa = mantisa / 10 + ((mantisa % 10 >= 5) ? 1 : 0);
+    numDigitsAfterDecimalPoint--;
+  }
+
+  u64 divisor = powersOf10[numDigitsAfterDecimalPoint];
+  u64 integerPart = mantisa / divisor;
+  u64 fractionPart = mantisa % divisor;
+
+  u64 fraction = divideU128(fractionPart >> (64 - FIXED64_FRACTION_BITS),
+                            fractionPart << FIXED64_FRACTION_BITS,
+                            divisor);
+  return fixed64((int64_t)((integerPart << FIXED64_FRACTION_BITS) + fraction));
+}
+
+// NOTE(Hakan): Comparisons and logical operators produce 1 or 0 and anything
+// but 0 counts as true
+template <typename Number> static inline Number numberFromBool(bool32 value);
+template <> inline r64 numberFromBool<r64>(bool32 value) { return value ? 1.0 : 0.0; }
+template <> inline r32 numberFromBool<r32>(bool32 value) { return value ? 1.0f : 0.0f; }
+template <> inline Fixed64 numberFromBool<Fixed64>(bool32 value) { return fixed64(value ? FIXED64_ONE : 0); }
+
+template <typename Number> static inline Number numberPi();
+template <> inline r64 numberPi<r64>() { return PI; }
+template <> inline r32 numberPi<r32>() { return (r32)PI; }
+template <> inline Fixed64 numberPi<Fixed64>() { return fixed64(FIXED64_PI); }
+
+static inline r64 numberToR64(r64 x) { return x; }
+static inline r64 numberToR64(r32 x) { return (r64)x; }
+static inline r64 numberToR64(Fixed64 x) { return (r64)x.value / (r64)FIXED64_ONE; }
+
+#endif // NUMBER_HEADER_INCLUDED_H
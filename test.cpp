@@ -42,18 +42,33 @@ static void putNumberToken(StringBuilder *expr, r64 number) {
   // stringBuilderPut(expr, ')');
 }
 
-static inline r64 insertGeneratedExpr(StringBuilder *expr);
+// NOTE(Hakan): The expected value of a number is parsed from the same text the
+// evaluator sees, so the reference and the evaluator round constants alike
+template <typename Number>
+static Number parseNumberText(char *text) {
+  Token token = {};
+  token.type = Token_Number;
+  token.text = text;
+  token.textLength = strlen(text);
+  return numberTokenToValue<Number>(&token);
+}
+
+template <typename Number>
+static inline Number insertGeneratedExpr(StringBuilder *expr);
 
-static r64 insertOperatorAndNullTerminate(StringBuilder *out) {
-  r64 result = 0;
+template <typename Number>
+static Number insertOperatorAndNullTerminate(StringBuilder *out) {
+  Number result = {};
   bool32 isOperandNumber = (rand() % 3) < 2;
   if (isOperandNumber) {
-    result = getRandPrintFriendlyNumber(-99999.0, 99999.0);
-    putNumberToken(out, result);
+    char *numberText = out->at;
+    putNumberToken(out, getRandPrintFriendlyNumber(-99999.0, 99999.0));
+    *out->at = '\0';
+    result = parseNumberText<Number>(numberText);
   }
   else {
     stringBuilderPut(out, '(');
-    result = insertGeneratedExpr(out);
+    result = insertGeneratedExpr<Number>(out);
     stringBuilderPut(out, ')');
   }
   stringBuilderPut(out, '\0');
@@ -61,10 +76,11 @@ static r64 insertOperatorAndNullTerminate(StringBuilder *out) {
   return result;
 }
 
-static inline r64 insertGeneratedExpr(StringBuilder *expr) {
-  r64 result = 0;
-  r64 leftOperandResult = 0;
-  r64 rightOperandResult = 0;
+template <typename Number>
+static inline Number insertGeneratedExpr(StringBuilder *expr) {
+  Number result = {};
+  Number leftOperandResult = {};
+  Number rightOperandResult = {};
 
   StringBuilder leftOperand = {};
   leftOperand.at = leftOperand.text;
@@ -72,11 +88,67 @@ static inline r64 insertGeneratedExpr(StringBuilder *expr) {
   StringBuilder rightOperand = {};
   rightOperand.at = rightOperand.text;
 
-  leftOperandResult = insertOperatorAndNullTerminate(&leftOperand);
-  rightOperandResult = insertOperatorAndNullTerminate(&rightOperand);
+  leftOperandResult = insertOperatorAndNullTerminate<Number>(&leftOperand);
+  rightOperandResult = insertOperatorAndNullTerminate<Number>(&rightOperand);
 
-  TokenType op = (TokenType)(rand() % (Token_OpEnd - Token_OpStart));
+  TokenType op = (TokenType)(Token_OpStart + 1 + rand() % (Token_OpEnd - Token_OpStart - 1));
   switch(op) {
+    case Token_OpOr: {
+      stringBuilderPuts(expr, leftOperand.text);
+      stringBuilderPuts(expr, "||");
+      stringBuilderPuts(expr, rightOperand.text);
+
+      result = numberFromBool<Number>((bool32)((leftOperandResult != numberFromBool<Number>(0)) | (rightOperandResult != numberFromBool<Number>(0))));
+    } break;
+    case Token_OpAnd: {
+      stringBuilderPuts(expr, leftOperand.text);
+      stringBuilderPuts(expr, "&&");
+      stringBuilderPuts(expr, rightOperand.text);
+
+      result = numberFromBool<Number>((bool32)((leftOperandResult != numberFromBool<Number>(0)) & (rightOperandResult != numberFromBool<Number>(0))));
+    } break;
+    case Token_OpEqual: {
+      stringBuilderPuts(expr, leftOperand.text);
+      stringBuilderPuts(expr, "==");
+      stringBuilderPuts(expr, rightOperand.text);
+
+      result = numberFromBool<Number>((bool32)(leftOperandResult == rightOperandResult));
+    } break;
+    case Token_OpNotEqual: {
+      stringBuilderPuts(expr, leftOperand.text);
+      stringBuilderPuts(expr, "!=");
+      stringBuilderPuts(expr, rightOperand.text);
+
+      result = numberFromBool<Number>((bool32)(leftOperandResult != rightOperandResult));
+    } break;
+    case Token_OpLess: {
+      stringBuilderPuts(expr, leftOperand.text);
+      stringBuilderPuts(expr, "<");
+      stringBuilderPuts(expr, rightOperand.text);
+
+      result = numberFromBool<Number>((bool32)(leftOperandResult < rightOperandResult));
+    } break;
+    case Token_OpLessEqual: {
+      stringBuilderPuts(expr, leftOperand.text);
+      stringBuilderPuts(expr, "<=");
+      stringBuilderPuts(expr, rightOperand.text);
+
+      result = numberFromBool<Number>((bool32)(leftOperandResult <= rightOperandResult));
+    } break;
+    case Token_OpGreater: {
+      stringBuilderPuts(expr, leftOperand.text);
+      stringBuilderPuts(expr, ">");
+      stringBuilderPuts(expr, rightOperand.text);
+
+      result = numberFromBool<Number>((bool32)(leftOperandResult > rightOperandResult));
+    } break;
+    case Token_OpGreaterEqual: {
+      stringBuilderPuts(expr, leftOperand.text);
+      stringBuilderPuts(expr, ">=");
+      stringBuilderPuts(expr, rightOperand.text);
+
+      result = numberFromBool<Number>((bool32)(leftOperandResult >= rightOperandResult));
+    } break;
     case Token_OpAdd: {
       stringBuilderPuts(expr, leftOperand.text);
       stringBuilderPut(expr, '+');
@@ -110,28 +182,28 @@ static inline r64 insertGeneratedExpr(StringBuilder *expr) {
       stringBuilderPut(expr, '^');
       stringBuilderPuts(expr, rightOperand.text);
 
-      result = pow(leftOperandResult, rightOperandResult);
+      result = numberPow(leftOperandResult, rightOperandResult);
     } break;
     case Token_OpSin: {
       stringBuilderPuts(expr, "sin(");
       stringBuilderPuts(expr, leftOperand.text);
       stringBuilderPut(expr, ')');
 
-      result = sin(leftOperandResult);
+      result = numberSin(leftOperandResult);
     } break;
     case Token_OpCos: {
       stringBuilderPuts(expr, "cos(");
       stringBuilderPuts(expr, leftOperand.text);
       stringBuilderPut(expr, ')');
 
-      result = cos(leftOperandResult);
+      result = numberCos(leftOperandResult);
     } break;
     case Token_OpTan: {
       stringBuilderPuts(expr, "tan(");
       stringBuilderPuts(expr, leftOperand.text);
       stringBuilderPut(expr, ')');
 
-      result = tan(leftOperandResult);
+      result = numberTan(leftOperandResult);
     } break;
     case Token_OpMax: {
       stringBuilderPuts(expr, "max(");
@@ -149,9 +221,25 @@ static inline r64 insertGeneratedExpr(StringBuilder *expr) {
       stringBuilderPuts(expr, rightOperand.text);
       stringBuilderPut(expr, ')');
 
-      result = (leftOperandResult <= rightOperandResult) ? leftOperandResult : rightOperandResult;
+      result = (leftOperandResult < rightOperandResult) ? leftOperandResult : rightOperandResult;
+    } break;
+    case Token_OpIf: {
+      StringBuilder elseOperand = {};
+      elseOperand.at = elseOperand.text;
+      Number elseOperandResult = insertOperatorAndNullTerminate<Number>(&elseOperand);
+
+      stringBuilderPuts(expr, "if(");
+      stringBuilderPuts(expr, leftOperand.text);
+      stringBuilderPut(expr, ',');
+      stringBuilderPuts(expr, rightOperand.text);
+      stringBuilderPut(expr, ',');
+      stringBuilderPuts(expr, elseOperand.text);
+      stringBuilderPut(expr, ')');
+
+      result = (leftOperandResult != numberFromBool<Number>(0)) ? rightOperandResult : elseOperandResult;
     } break;
 
+
     default: {
       stringBuilderPuts(expr, leftOperand.text);
       stringBuilderPut(expr, '+');
@@ -164,49 +252,982 @@ static inline r64 insertGeneratedExpr(StringBuilder *expr) {
   return result;
 }
 
+// NOTE(Hakan): Floating point results may differ in the last few bits
+// depending on how the compiler schedules the math, fixed point results are
+// bit exact.
+static bool32 isWithinTolerance(r64 result, r64 correctResult) {
+  if (isnan(result) || isnan(correctResult)) {
+    return (bool32)(isnan(result) && isnan(correctResult));
+  }
+  if (result == correctResult) {
+    return 1;
+  }
+  r64 magnitude = fabs(correctResult) > 1.0 ? fabs(correctResult) : 1.0;
+  return (bool32)(fabs(result - correctResult) <= 1e-9 * magnitude);
+}
+
+static bool32 isWithinTolerance(r32 result, r32 correctResult) {
+  if (isnan(result) || isnan(correctResult)) {
+    return (bool32)(isnan(result) && isnan(correctResult));
+  }
+  if (result == correctResult) {
+    return 1;
+  }
+  r32 magnitude = fabsf(correctResult) > 1.0f ? fabsf(correctResult) : 1.0f;
+  return (bool32)(fabsf(result - correctResult) <= 1e-5f * magnitude);
+}
+
+static bool32 isWithinTolerance(Fixed64 result, Fixed64 correctResult) {
+  return (bool32)(result == correctResult);
+}
+
+template <typename Number>
+static void testExprEval(int testSamples) {
+  int numberFailedTests = 0;
+  TimeUnit avgClockCycles = 0;
+
+  puts("################################");
+  printf("# Testing %-7s expr eval    #\n", getNumberTypeName(getNumberType<Number>()));
+  puts("################################");
+  for (int i = 0; i < testSamples; i++) {
+    Tokenizer tokenizer = {};
+    StringBuilder stringBuilder = {};
+    stringBuilder.at = stringBuilder.text;
+
+    Number correctResult = insertGeneratedExpr<Number>(&stringBuilder);
+    stringBuilderPut(&stringBuilder, '\0');
+
+    tokenizer.at = stringBuilder.text;
+
+    START_TIMEDBLOCK("EVAL");
+    Number result = evalExpression<Number>(&tokenizer);
+    avgClockCycles += GET_TIMEDBLOCK("EVAL");
+
+    if (!isWithinTolerance(result, correctResult)) {
+      fputs(stringBuilder.text, stdout);
+      printf(" = %f = %f\n", numberToR64(result), numberToR64(correctResult));
+      numberFailedTests++;
+    }
+  }
+
+  printf("## Average clock pulses %f\n", (r64)avgClockCycles / (r64)testSamples);
+  const int succeddedTests = (testSamples - numberFailedTests);
+  printf("## %d/%d(%.1f%%) test succeeded\n\n", succeddedTests, testSamples, 100.0*((r64)succeddedTests/(r64)testSamples));
+}
+
+// NOTE(Hakan): testExprEval() computes what it expects with the same number.h
+// math it tests, so it can't tell a wrong r32 or Fixed64 operation from a
+// right one. Here the same text is evaluated as r64 too, and the result has
+// to be within what the type can resolve, relative to the larger of the
+// result and the operands. Operands stay where the operation is well
+// conditioned, and Fixed64 results that overflow are skipped.
+template <typename Number>
+static void testAccuracy(int testSamples) {
+  static const TokenType operators[] = {
+    Token_OpAdd, Token_OpSub, Token_OpMul, Token_OpDiv, Token_OpPow,
+    Token_OpSin, Token_OpCos, Token_OpTan, Token_OpMax, Token_OpMin,
+    Token_Number,
+  };
+  const r64 tolerance = (getNumberType<Number>() == NumberType_R32) ? 1e-5 : 1e-8;
+  const r64 maxMagnitude = (getNumberType<Number>() == NumberType_Fixed64) ? 1e9 : 1e30;
+  int numberFailedTests = 0;
+  int numberSkippedTests = 0;
+
+  puts("################################");
+  printf("# Testing %-7s accuracy     #\n", getNumberTypeName(getNumberType<Number>()));
+  puts("################################");
+  for (int i = 0; i < testSamples; i++) {
+    TokenType op = operators[rand() % ArrayCount(operators)];
+    r64 left = getRandPrintFriendlyNumber(-99999.0, 99999.0);
+    r64 right = getRandPrintFriendlyNumber(-99999.0, 99999.0);
+    char text[128];
+    switch (op) {
+      case Token_OpAdd: snprintf(text, sizeof(text), "%f+%f", left, right); break;
+      case Token_OpSub: snprintf(text, sizeof(text), "%f-%f", left, right); break;
+      case Token_OpMul: snprintf(text, sizeof(text), "%f*%f", left, right); break;
+      case Token_OpDiv: {
+        right = getRandPrintFriendlyNumber(0.5, 10.0) * ((rand() % 2) ? 1 : -1);
+        snprintf(text, sizeof(text), "%f/%f", left, right);
+      } break;
+      case Token_OpPow: {
+        left = getRandPrintFriendlyNumber(0.1, 10.0);
+        right = getRandPrintFriendlyNumber(-5.0, 5.0);
+        snprintf(text, sizeof(text), "%f^%f", left, right);
+      } break;
+      case Token_OpSin: {
+        left = getRandPrintFriendlyNumber(-10.0, 10.0);
+        snprintf(text, sizeof(text), "sin(%f)", left);
+      } break;
+      case Token_OpCos: {
+        left = getRandPrintFriendlyNumber(-10.0, 10.0);
+        snprintf(text, sizeof(text), "cos(%f)", left);
+      } break;
+      case Token_OpTan: {
+        do {
+          left = getRandPrintFriendlyNumber(-10.0, 10.0);
+        } while (fabs(cos(left)) < 0.1);
+        snprintf(text, sizeof(text), "tan(%f)", left);
+      } break;
+      case Token_OpMax: snprintf(text, sizeof(text), "max(%f,%f)", left, right); break;
+      case Token_OpMin: snprintf(text, sizeof(text), "min(%f,%f)", left, right); break;
+      // NOTE(Hakan): Literals with more digits than any type resolves
+      case Token_Number: {
+        left = ((r64)rand() / RAND_MAX) * 2.0 - 1.0;
+        snprintf(text, sizeof(text), "%.19f", left);
+      } break;
+    }
+    if ((op != Token_OpAdd) && (op != Token_OpSub) && (op != Token_OpMul) && (op != Token_OpDiv) &&
+        (op != Token_OpPow) && (op != Token_OpMax) && (op != Token_OpMin)) {
+      right = 0;
+    }
+
+    Tokenizer tokenizer = {};
+    tokenizer.at = text;
+    r64 result = numberToR64(evalExpression<Number>(&tokenizer));
+    tokenizer = {};
+    tokenizer.at = text;
+    r64 correctResult = evalExpression<r64>(&tokenizer);
+
+    if (fabs(correctResult) > maxMagnitude) {
+      numberSkippedTests++;
+      continue;
+    }
+
+    r64 magnitude = fabs(correctResult);
+    magnitude = (fabs(left) > magnitude) ? fabs(left) : magnitude;
+    magnitude = (fabs(right) > magnitude) ? fabs(right) : magnitude;
+    if (!(fabs(result - correctResult) <= tolerance * (1.0 + magnitude))) {
+      printf("%s = %.10f = %.10f\n", text, result, correctResult);
+      numberFailedTests++;
+    }
+  }
+
+  const int testedSamples = (testSamples - numberSkippedTests);
+  const int succeddedTests = (testedSamples - numberFailedTests);
+  printf("## %d/%d(%.1f%%) test succeeded, %d overflowing skipped\n\n", succeddedTests, testedSamples,
+         100.0*((r64)succeddedTests/(r64)testedSamples), numberSkippedTests);
+}
+
+// NOTE(Hakan): Formulas over x and y with branches that don't fold away, shared
+// by the batch evaluation and program image tests
+static const char *variableFormulas[] = {
+  "if(x < 0, 0 - x, x)",
+  "if(x < y && y < 1, if(x > 0.5, x*y, x + y), max(x, y))*2",
+  "if(x >= 0 || y >= 0, sin(x) + cos(y), if(x == y, 1, x/y))",
+  "(x < y) + (x <= 0.25) + (y != x) + (x > y)*2",
+  "if(1 < 2, x, y) - if(x < 100, y, 0)",
+  "if(x < 0, if(y < 0, 1, 2), if(y < 0, 3, 4))",
+};
+
+// NOTE(Hakan): Every row of a batch evaluation has to match evaluating the same
+// program one row at a time, with conditions that are mixed within a block as
+// well as ones that are uniform
+template <typename Number>
+static void testBatchEval(int rowCount) {
+  const char **formulas = variableFormulas;
+  int numberFailedTests = 0;
+
+  puts("################################");
+  printf("# Testing %-7s batch eval   #\n", getNumberTypeName(getNumberType<Number>()));
+  puts("################################");
+
+  Number *columns[2];
+  columns[0] = (Number*)malloc(sizeof(Number) * rowCount);
+  columns[1] = (Number*)malloc(sizeof(Number) * rowCount);
+  Number *results = (Number*)malloc(sizeof(Number) * rowCount);
+  for (int rowIndex = 0; rowIndex < rowCount; rowIndex++) {
+    for (int columnIndex = 0; columnIndex < 2; columnIndex++) {
+      char text[50];
+      snprintf(text, 50, "%.3f", getRandPrintFriendlyNumber(-2.0, 2.0));
+      columns[columnIndex][rowIndex] = parseNumberText<Number>(text);
+    }
+  }
+
+  for (size_t formulaIndex = 0; formulaIndex < ArrayCount(variableFormulas); formulaIndex++) {
+    Tokenizer tokenizer = {};
+    tokenizer.at = const_cast<char*>(formulas[formulaIndex]);
+    Program program;
+    if (!compileExpression<Number>(&tokenizer, &program)) {
+      printf("%s in %s\n", tokenizer.error, formulas[formulaIndex]);
+      numberFailedTests += rowCount;
+      continue;
+    }
+
+    Number *variables[2];
+    for (size_t variableIndex = 0; variableIndex < program.variableCount; variableIndex++) {
+      char *name = program.variableNames + program.variableNameOffsets[variableIndex];
+      variables[variableIndex] = (name[0] == 'x') ? columns[0] : columns[1];
+    }
+
+    evalProgramBatch(&program, variables, rowCount, results);
+
+    for (int rowIndex = 0; rowIndex < rowCount; rowIndex++) {
+      Number rowVariables[2];
+      for (size_t variableIndex = 0; variableIndex < program.variableCount; variableIndex++) {
+        rowVariables[variableIndex] = variables[variableIndex][rowIndex];
+      }
+
+      Number correctResult = evalProgram(&program, rowVariables);
+      if (!isWithinTolerance(results[rowIndex], correctResult)) {
+        printf("%s row %d = %f = %f\n", formulas[formulaIndex], rowIndex,
+               numberToR64(results[rowIndex]), numberToR64(correctResult));
+        numberFailedTests++;
+      }
+    }
+
+    freeProgram(&program);
+  }
+
+  free(columns[0]);
+  free(columns[1]);
+  free(results);
+
+  const int testSamples = rowCount * (int)ArrayCount(variableFormulas);
+  const int succeddedTests = (testSamples - numberFailedTests);
+  printf("## %d/%d(%.1f%%) test succeeded\n\n", succeddedTests, testSamples, 100.0*((r64)succeddedTests/(r64)testSamples));
+}
+
+static void nativeHypot(r64 **arguments, r64 *results, size_t rowCount, void *userData) {
+  size_t *callCount = (size_t*)userData;
+  (*callCount)++;
+  for (size_t rowIndex = 0; rowIndex < rowCount; rowIndex++) {
+    results[rowIndex] = sqrt(arguments[0][rowIndex]*arguments[0][rowIndex] + arguments[1][rowIndex]*arguments[1][rowIndex]);
+  }
+}
+
+static r64 referenceSq(r64 x) { return x*x; }
+static r64 referenceF(r64 x, r64 y) { return x*y + sin(x); }
+static r64 referenceClamp(r64 x, r64 lo, r64 hi) { return (lo > ((x < hi) ? x : hi)) ? lo : ((x < hi) ? x : hi); }
+static r64 referencePiecewise(r64 x) { return (x < 0) ? (0 - x) : referenceSq(x); }
+
+static r64 referenceFormula0(r64 x, r64 y) { return referenceF(x, 2) + referenceSq(x + 1) + referenceClamp(y, -0.5, 0.5); }
+static r64 referenceFormula1(r64 x, r64 y) { return referencePiecewise(x - y) * 2; }
+static r64 referenceFormula2(r64 x, r64 y) { return sqrt(x*x + referenceSq(y)*referenceSq(y)) + referenceF(y, x); }
+
+// NOTE(Hakan): Expression functions have to give the same result as writing
+// their bodies out by hand, and native functions have to be called once per
+// block of rows in batch evaluation
+static void testFunctions(int rowCount) {
+  static const char *definitions[] = {
+    "sq(x) = x*x",
+    "f(x, y) = x*y + sin(x)",
+    "g(x) = f(x, 2) + sq(x + 1)",
+    "clamp(x, lo, hi) = max(lo, min(x, hi))",
+    "piecewise(x) = if(x < 0, 0 - x, sq(x))",
+    "two() = 2",
+    "halves(x) = x/2 + x/2",
+  };
+  static const char *formulas[] = {
+    "g(x) + clamp(y, -0.5, 0.5)",
+    "piecewise(x - y)*two()",
+    "hypot(x, sq(y)) + f(y, x)",
+  };
+  typedef r64 ReferenceFormula(r64 x, r64 y);
+  static ReferenceFormula *referenceFormulas[] = {
+    referenceFormula0,
+    referenceFormula1,
+    referenceFormula2,
+  };
+  int numberFailedTests = 0;
+
+  puts("################################");
+  puts("####### Testing functions ######");
+  puts("################################");
+
+  size_t nativeCallCount = 0;
+  FunctionTable functions = {};
+  for (size_t definitionIndex = 0; definitionIndex < ArrayCount(definitions); definitionIndex++) {
+    if (!defineFunction(&functions, definitions[definitionIndex])) {
+      printf("Failed to define %s\n", definitions[definitionIndex]);
+      numberFailedTests++;
+    }
+  }
+  defineNativeFunction<r64>(&functions, "hypot", 2, nativeHypot, &nativeCallCount);
+
+  // NOTE(Hakan): A body that doesn't reduce to one value must not be defined
+  static const char *malformedDefinitions[] = {
+    "bad(x) = x x", "bad(x) = x +", "bad(x) = ", "bad(x) = sq(x) 1",
+  };
+  for (size_t definitionIndex = 0; definitionIndex < ArrayCount(malformedDefinitions); definitionIndex++) {
+    if (defineFunction(&functions, malformedDefinitions[definitionIndex])) {
+      printf("Defined malformed %s\n", malformedDefinitions[definitionIndex]);
+      numberFailedTests++;
+    }
+  }
+
+  // NOTE(Hakan): Calls with constant arguments fold down to one constant
+  {
+    Tokenizer tokenizer = {};
+    tokenizer.at = const_cast<char*>("g(3) + piecewise(-2)*two()");
+    tokenizer.functions = &functions;
+    Program program = {};
+    r64 result = 0;
+    if (compileExpression<r64>(&tokenizer, &program)) {
+      result = evalProgram(&program, (r64*)0);
+    }
+
+    r64 correctResult = referenceF(3, 2) + referenceSq(4) + referencePiecewise(-2)*2;
+    if ((program.codeCount != 1) || !isWithinTolerance(result, correctResult)) {
+      printf("Folded %zu instructions = %f = %f\n", program.codeCount, result, correctResult);
+      numberFailedTests++;
+    }
+    freeProgram(&program);
+  }
+
+  // NOTE(Hakan): Every argument is evaluated once however often the body uses
+  // it, so nested calls grow the program linearly and not 2^depth
+  {
+    const int nestingDepth = 32;
+    char text[16*nestingDepth];
+    char *at = text;
+    for (int depth = 0; depth < nestingDepth; depth++) {
+      at += sprintf(at, "halves(");
+    }
+    at += sprintf(at, "y + 1");
+    for (int depth = 0; depth < nestingDepth; depth++) {
+      *at++ = ')';
+    }
+    *at = '\0';
+
+    Tokenizer tokenizer = {};
+    tokenizer.at = text;
+    tokenizer.functions = &functions;
+    Program program = {};
+    r64 y = 0.25;
+    r64 result = 0;
+    if (compileExpression<r64>(&tokenizer, &program)) {
+      result = evalProgram(&program, &y);
+    }
+
+    if ((program.codeCount > 10*nestingDepth) || !isWithinTolerance(result, y + 1)) {
+      printf("Nested calls took %zu instructions = %f\n", program.codeCount, result);
+      numberFailedTests++;
+    }
+    freeProgram(&program);
+  }
+
+  // NOTE(Hakan): Malformed expressions have to be reported, not evaluated
+  {
+    static const char *malformedExpressions[] = {
+      "sq(1, 2)", "sq + 1", "1 +", "(1 + 2", "1 + 2)", "1 2",
+      "if(1, 2)", "if(1, 2, 3, 4)", "max(1)", "sin()", "(1, 2)", "1, 2",
+      "f(1, )", "f(, 1)", "max(1, , 2)", "if 1 2 3", "1 2 if 3", "max 1 2",
+      "1 + 2 3 *", "max(1 2 +, 3)", "(1)(2)", "* 2", "(1 +)",
+    };
+    for (size_t exprIndex = 0; exprIndex < ArrayCount(malformedExpressions); exprIndex++) {
+      Tokenizer tokenizer = {};
+      tokenizer.at = const_cast<char*>(malformedExpressions[exprIndex]);
+      tokenizer.functions = &functions;
+      Program program = {};
+      if (compileExpression<r64>(&tokenizer, &program)) {
+        printf("Compiled malformed %s\n", malformedExpressions[exprIndex]);
+        numberFailedTests++;
+      }
+      freeProgram(&program);
+    }
+
+    // NOTE(Hakan): compileProgram() takes any RTN, an if() without its branch
+    // markers has to be refused there too
+    char one[] = "1";
+    Token tokens[4] = {};
+    for (int tokenIndex = 0; tokenIndex < 3; tokenIndex++) {
+      tokens[tokenIndex].type = Token_Number;
+      tokens[tokenIndex].text = one;
+      tokens[tokenIndex].textLength = 1;
+    }
+    tokens[3].type = Token_OpIf;
+    ListOfTokens rtn = {tokens, 4, 4, &functions};
+    Program program = {};
+    char error[ERROR_MESSAGE_SIZE];
+    if (compileProgram<r64>(&rtn, &program, error)) {
+      puts("Compiled if() without branch markers");
+      numberFailedTests++;
+    }
+    freeProgram(&program);
+  }
+
+  r64 *columns[2];
+  columns[0] = (r64*)malloc(sizeof(r64) * rowCount);
+  columns[1] = (r64*)malloc(sizeof(r64) * rowCount);
+  r64 *results = (r64*)malloc(sizeof(r64) * rowCount);
+  for (int rowIndex = 0; rowIndex < rowCount; rowIndex++) {
+    columns[0][rowIndex] = getRandPrintFriendlyNumber(-2.0, 2.0);
+    columns[1][rowIndex] = getRandPrintFriendlyNumber(-2.0, 2.0);
+  }
+
+  for (size_t formulaIndex = 0; formulaIndex < ArrayCount(formulas); formulaIndex++) {
+    Tokenizer tokenizer = {};
+    tokenizer.at = const_cast<char*>(formulas[formulaIndex]);
+    tokenizer.functions = &functions;
+    Program program;
+    if (!compileExpression<r64>(&tokenizer, &program)) {
+      printf("%s in %s\n", tokenizer.error, formulas[formulaIndex]);
+      numberFailedTests += rowCount;
+      continue;
+    }
+
+    r64 *variables[2];
+    for (size_t variableIndex = 0; variableIndex < program.variableCount; variableIndex++) {
+      char *name = program.variableNames + program.variableNameOffsets[variableIndex];
+      variables[variableIndex] = (name[0] == 'x') ? columns[0] : columns[1];
+    }
+
+    nativeCallCount = 0;
+    evalProgramBatch(&program, variables, rowCount, results);
+    bool32 callsNative = (bool32)(strstr(formulas[formulaIndex], "hypot") != 0);
+    size_t expectedCallCount = callsNative ? ((rowCount + BATCH_LANE_COUNT - 1) / BATCH_LANE_COUNT) : 0;
+    if (nativeCallCount != expectedCallCount) {
+      printf("%s called hypot %zu times instead of %zu\n", formulas[formulaIndex], nativeCallCount, expectedCallCount);
+      numberFailedTests++;
+    }
+
+    for (int rowIndex = 0; rowIndex < rowCount; rowIndex++) {
+      r64 x = columns[0][rowIndex];
+      r64 y = columns[1][rowIndex];
+      r64 rowVariables[2];
+      for (size_t variableIndex = 0; variableIndex < program.variableCount; variableIndex++) {
+        rowVariables[variableIndex] = variables[variableIndex][rowIndex];
+      }
+
+      r64 correctResult = referenceFormulas[formulaIndex](x, y);
+      r64 result = evalProgram(&program, rowVariables);
+      if (!isWithinTolerance(result, correctResult) || !isWithinTolerance(results[rowIndex], correctResult)) {
+        printf("%s with x = %f, y = %f = %f, %f = %f\n", formulas[formulaIndex], x, y,
+               result, results[rowIndex], correctResult);
+        numberFailedTests++;
+      }
+    }
+
+    freeProgram(&program);
+  }
+
+  free(columns[0]);
+  free(columns[1]);
+  free(results);
+  freeFunctionTable(&functions);
+
+  const int testSamples = rowCount * (int)ArrayCount(formulas);
+  const int succeddedTests = (testSamples - numberFailedTests);
+  printf("## %d/%d(%.1f%%) test succeeded\n\n", succeddedTests, testSamples, 100.0*((r64)succeddedTests/(r64)testSamples));
+}
+
+struct StringSource {
+  char *at;
+  char *end;
+};
+
+// NOTE(Hakan): Hands out the string in reads of random length, like a pipe
+static size_t readStringInRandomChunks(void *source, char *buffer, size_t size) {
+  StringSource *string = (StringSource*)source;
+  size_t readCount = 1 + rand() % 4096;
+  if (readCount > size) {
+    readCount = size;
+  }
+  if (readCount > (size_t)(string->end - string->at)) {
+    readCount = string->end - string->at;
+  }
+
+  memcpy(buffer, string->at, readCount);
+  string->at += readCount;
+  return readCount;
+}
+
+// NOTE(Hakan): Like a pipe whose writer dies before closing it, the whole
+// string arrives and then the read fails instead of reaching the end
+static size_t readStringThenFail(void *source, char *buffer, size_t size) {
+  StringSource *string = (StringSource*)source;
+  return (string->at == string->end) ? READ_INPUT_FAILED : readStringInRandomChunks(source, buffer, size);
+}
+
+// NOTE(Hakan): Joins exprCount generated expressions with '+', and every now
+// and then a run of whitespace longer than a tokenizer block
+static void putGeneratedSum(char **at, int exprCount) {
+  for (int exprIndex = 0; exprIndex < exprCount; exprIndex++) {
+    if (exprIndex > 0) {
+      *(*at)++ = '+';
+    }
+    if (rand() % 500 == 0) {
+      memset(*at, (rand() % 2) ? ' ' : '\n', TOKENIZER_BLOCK_SIZE + 1);
+      *at += TOKENIZER_BLOCK_SIZE + 1;
+    }
+
+    StringBuilder stringBuilder = {};
+    stringBuilder.at = stringBuilder.text;
+    insertGeneratedExpr<r64>(&stringBuilder);
+    size_t exprLength = stringBuilder.at - stringBuilder.text;
+    memcpy(*at, stringBuilder.text, exprLength);
+    *at += exprLength;
+  }
+}
+
+// NOTE(Hakan): Expressions spanning many tokenizer blocks, with calls to
+// expression functions whose arguments span blocks too, have to compile to
+// the same program when they are streamed as when they are one string
+static void testStreaming(int testSamples) {
+  const int exprCount = 1000;
+  int numberFailedTests = 0;
+
+  puts("################################");
+  puts("####### Testing streaming ######");
+  puts("################################");
+
+  FunctionTable functions = {};
+  defineFunction(&functions, "sq(x) = x*x");
+  defineFunction(&functions, "f(x, y) = x*y + sin(x)");
+
+  size_t textCapacity = 4 * exprCount * (sizeof(StringBuilder) + TOKENIZER_BLOCK_SIZE / 250);
+  char *text = (char*)malloc(textCapacity);
+  for (int i = 0; i < testSamples; i++) {
+    char *at = text;
+    memcpy(at, "sq(", 3); at += 3;
+    putGeneratedSum(&at, exprCount);
+    memcpy(at, ") + f(", 6); at += 6;
+    putGeneratedSum(&at, exprCount);
+    *at++ = ',';
+    putGeneratedSum(&at, exprCount);
+    memcpy(at, ") - ", 4); at += 4;
+    putGeneratedSum(&at, exprCount);
+    *at = '\0';
+    ASSERT(at < text + textCapacity);
+
+    Tokenizer tokenizer = {};
+    tokenizer.at = text;
+    tokenizer.functions = &functions;
+    Program program = {};
+    bool32 isCompiled = compileExpression<r64>(&tokenizer, &program);
+
+    StringSource source = {text, at};
+    Tokenizer streamTokenizer = {};
+    streamTokenizer.functions = &functions;
+    beginTokenizerStream(&streamTokenizer, readStringInRandomChunks, &source);
+    Program streamProgram = {};
+    isCompiled &= compileExpression<r64>(&streamTokenizer, &streamProgram);
+    endTokenizerStream(&streamTokenizer);
+
+    r64 result = isCompiled ? evalProgram(&streamProgram, (r64*)0) : 0;
+    r64 correctResult = isCompiled ? evalProgram(&program, (r64*)0) : 1;
+    if ((streamProgram.codeCount != program.codeCount) ||
+        (streamProgram.constantCount != program.constantCount) ||
+        (memcmp(&result, &correctResult, sizeof(r64)) != 0)) {
+      printf("Streamed %zu bytes to %zu instructions = %f, %zu instructions = %f\n", (size_t)(at - text),
+             streamProgram.codeCount, result, program.codeCount, correctResult);
+      numberFailedTests++;
+    }
+
+    // NOTE(Hakan): Even though every byte was read, a failed read must not
+    // pass for the end of the expression
+    StringSource failingSource = {text, at};
+    Tokenizer failingTokenizer = {};
+    failingTokenizer.functions = &functions;
+    beginTokenizerStream(&failingTokenizer, readStringThenFail, &failingSource);
+    Program failingProgram = {};
+    if (compileExpression<r64>(&failingTokenizer, &failingProgram)) {
+      printf("Compiled %zu bytes of an input that failed to read\n", (size_t)(at - text));
+      numberFailedTests++;
+    }
+    endTokenizerStream(&failingTokenizer);
+
+    freeProgram(&program);
+    freeProgram(&streamProgram);
+    freeProgram(&failingProgram);
+  }
+
+  free(text);
+  freeFunctionTable(&functions);
+
+  const int succeddedTests = (testSamples - numberFailedTests);
+  printf("## %d/%d(%.1f%%) test succeeded\n\n", succeddedTests, testSamples, 100.0*((r64)succeddedTests/(r64)testSamples));
+}
+
+// NOTE(Hakan): Evaluates a program of any numeric type with its variables named
+// x and y set to the given values
+template <typename Number>
+static r64 evalProgramAtAsR64(Program *program, r64 x, r64 y) {
+  ASSERT(program->variableCount <= 2);
+  Number variables[2] = {};
+  for (size_t variableIndex = 0; variableIndex < program->variableCount; variableIndex++) {
+    char *name = program->variableNames + program->variableNameOffsets[variableIndex];
+    char text[50];
+    snprintf(text, 50, "%.3f", (name[0] == 'x') ? x : y);
+    variables[variableIndex] = parseNumberText<Number>(text);
+  }
+
+  return numberToR64(evalProgram(program, variables));
+}
+
+static r64 evalProgramOfTypeAt(Program *program, r64 x, r64 y) {
+  switch (program->numberType) {
+    case NumberType_R32: return evalProgramAtAsR64<r32>(program, x, y);
+    case NumberType_Fixed64: return evalProgramAtAsR64<Fixed64>(program, x, y);
+    default: return evalProgramAtAsR64<r64>(program, x, y);
+  }
+}
+
+// NOTE(Hakan): The first instruction of a type in the record of an opened
+// image, or null when the program has none
+static Instruction *findImageInstruction(ProgramImage *image, size_t programIndex, u32 type) {
+  ProgramImageEntry *entry = &image->entries[programIndex];
+  Instruction *code = (Instruction*)(image->memory + entry->offset +
+                                     getNumberTypeSize((NumberType)entry->numberType) * entry->constantCount);
+  for (size_t codeIndex = 0; codeIndex < entry->codeCount; codeIndex++) {
+    if (code[codeIndex].type == type) {
+      return &code[codeIndex];
+    }
+  }
+
+  return 0;
+}
+
+// NOTE(Hakan): Writes call callDepth times and "1+(" nestingDepth times, then
+// unitCount times "x*0.5+(x-2)/4+" followed by "x" and the closing
+// parentheses, without ever holding more than one piece of it in memory
+struct LargeExpressionSource {
+  const char *call;
+  size_t callDepth;
+  size_t nestingDepth;
+  size_t unitCount;
+  size_t pieceIndex;
+
+  const char *piece;
+  size_t pieceLeft;
+};
+
+static size_t readLargeExpression(void *sourceData, char *buffer, size_t size) {
+  LargeExpressionSource *source = (LargeExpressionSource*)sourceData;
+  size_t result = 0;
+  while (result < size) {
+    if (source->pieceLeft == 0) {
+      size_t index = source->pieceIndex;
+      size_t openCount = source->callDepth + source->nestingDepth;
+      if (index < source->callDepth) {
+        source->piece = source->call;
+      }
+      else if (index < openCount) {
+        source->piece = "1+(";
+      }
+      else if (index < openCount + source->unitCount) {
+        source->piece = "x*0.5+(x-2)/4+";
+      }
+      else if (index == openCount + source->unitCount) {
+        source->piece = "x";
+      }
+      else if (index <= 2 * openCount + source->unitCount) {
+        source->piece = ")";
+      }
+      else {
+        break;
+      }
+
+      source->pieceLeft = strlen(source->piece);
+      source->pieceIndex++;
+    }
+
+    size_t copyCount = (source->pieceLeft < size - result) ? source->pieceLeft : (size - result);
+    memcpy(buffer + result, source->piece, copyCount);
+    source->piece += copyCount;
+    source->pieceLeft -= copyCount;
+    result += copyCount;
+  }
+
+  return result;
+}
+
+// NOTE(Hakan): Parse time per token has to stay flat as expressions grow, for
+// long flat sums as well as for deeply nested ones, and the arguments of
+// expression function calls are streamed like everything else, so wrapping a
+// whole expression in calls doesn't change that either
+static void benchmarkLargeExpressions(size_t maxTokenCount) {
+  int testSamples = 0;
+  int numberFailedTests = 0;
+
+  puts("################################");
+  puts("## Benchmark large expressions #");
+  puts("################################");
+
+  FunctionTable functions = {};
+  defineFunction(&functions, "sq(x) = x*x");
+  defineFunction(&functions, "id(x) = x");
+
+  const char *kindNames[] = {"flat", "nested", "sq", "calls"};
+  for (int kind = 0; kind < 4; kind++) {
+    for (size_t tokenCount = 1000000; tokenCount <= maxTokenCount; tokenCount *= 10) {
+      LargeExpressionSource source = {};
+      source.call = (kind == 2) ? "sq(" : "id(";
+      source.callDepth = (kind == 2) ? 1 : ((kind == 3) ? 1000 : 0);
+      source.nestingDepth = (kind == 1) ? (tokenCount / 2 / 4) : 0;
+      source.unitCount = (tokenCount - 3 * source.callDepth - 4 * source.nestingDepth) / 12;
+      size_t actualTokenCount = 3 * source.callDepth + 4 * source.nestingDepth + 12 * source.unitCount + 1;
+
+      clock_t startClock = clock();
+      Tokenizer tokenizer = {};
+      tokenizer.functions = &functions;
+      beginTokenizerStream(&tokenizer, readLargeExpression, &source);
+      Program program = {};
+      bool32 isCompiled = compileExpression<r64>(&tokenizer, &program);
+      endTokenizerStream(&tokenizer);
+      r64 seconds = (r64)(clock() - startClock) / CLOCKS_PER_SEC;
+
+      r64 x = 2;
+      r64 result = isCompiled ? evalProgram(&program, &x) : 0;
+      r64 correctResult = (r64)(source.nestingDepth + source.unitCount) + x;
+      if (kind == 2) {
+        correctResult *= correctResult;
+      }
+      if ((program.variableCount != 1) || (result != correctResult)) {
+        printf("%zu tokens = %f = %f\n", actualTokenCount, result, correctResult);
+        numberFailedTests++;
+      }
+      testSamples++;
+
+      printf("## %-6s %10zu tokens, depth %8zu: %6.3f s, %5.1f ns per token\n", kindNames[kind],
+             actualTokenCount, source.callDepth + source.nestingDepth, seconds, 1e9 * seconds / (r64)actualTokenCount);
+      freeProgram(&program);
+    }
+  }
+  freeFunctionTable(&functions);
+
+  const int succeddedTests = (testSamples - numberFailedTests);
+  printf("## %d/%d(%.1f%%) test succeeded\n\n", succeddedTests, testSamples, 100.0*((r64)succeddedTests/(r64)testSamples));
+}
+
 int main(int numArguments, char** arguments) {
   START_TIMEDBLOCK("test");
   srand((unsigned int)time(nullptr));
 
 #define TEST_ExprEval 1
+#define TEST_BatchEval 1
+#define TEST_Functions 1
+#define TEST_ProgramImage 1
+#define TEST_Streaming 1
+#define TEST_LargeExpression 1
+// NOTE(Hakan): Largest benchmarked expression, the output program takes about
+// 8 bytes per token
+#ifndef LARGE_EXPRESSION_MAX_TOKENS
+#define LARGE_EXPRESSION_MAX_TOKENS 100000000
+#endif
 // #define TEST_StringToDouble 1
 
 #if TEST_ExprEval
+  testExprEval<r64>(1000000);
+  testExprEval<r32>(1000000);
+  testExprEval<Fixed64>(1000000);
+  testAccuracy<r32>(1000000);
+  testAccuracy<Fixed64>(1000000);
+#endif
+
+#if TEST_BatchEval
+  testBatchEval<r64>(100000);
+  testBatchEval<r32>(100000);
+  testBatchEval<Fixed64>(100000);
+#endif
+
+#if TEST_Functions
+  testFunctions(100000);
+#endif
+
+#if TEST_ProgramImage
   {
-    const int testSamples = 1000000;
+    const int testSamples = 30000;
     int numberFailedTests = 0;
-    TimeUnit avgClockCycles = 0;
 
     puts("################################");
-    puts("# Testing math expression eval #");
+    puts("##### Testing program image ####");
     puts("################################");
+
+    // NOTE(Hakan): Every program runs over variables, and the calls are inlined
+    // with their arguments in local slots, so the image holds branches, locals
+    // and variables that have to survive the round trip
+    static const char *imageDefinitions[] = {
+      "sq(x) = x*x",
+      "clamp(x, lo, hi) = max(lo, min(x, hi))",
+      "piecewise(x) = if(x < 0, 0 - x, sq(x))",
+    };
+    static const char *callFormulas[] = {
+      "sq(x + y) - sq(x - y)",
+      "piecewise(x - y)*2 + clamp(y, -0.5, 0.5)",
+      "if(x < y, piecewise(y*x), sq(max(x, y)))",
+    };
+    const size_t formulaCount = ArrayCount(variableFormulas) + ArrayCount(callFormulas);
+
+    FunctionTable functions = {};
+    for (size_t definitionIndex = 0; definitionIndex < ArrayCount(imageDefinitions); definitionIndex++) {
+      defineFunction(&functions, imageDefinitions[definitionIndex]);
+    }
+
+    Program *programs = (Program*)calloc(testSamples, sizeof(Program));
+    r64 *inputs = (r64*)malloc(sizeof(r64) * 2 * testSamples);
+    r64 *correctResults = (r64*)malloc(sizeof(r64) * testSamples);
+    int branchingCount = 0;
+    int localsCount = 0;
     for (int i = 0; i < testSamples; i++) {
+      size_t formulaIndex = i % formulaCount;
+      const char *formula = (formulaIndex < ArrayCount(variableFormulas))
+                            ? variableFormulas[formulaIndex]
+                            : callFormulas[formulaIndex - ArrayCount(variableFormulas)];
+
       Tokenizer tokenizer = {};
-      StringBuilder stringBuilder = {};
-      stringBuilder.at = stringBuilder.text;
+      tokenizer.at = const_cast<char*>(formula);
+      tokenizer.functions = &functions;
+      NumberType numberType = (NumberType)((i / formulaCount) % NumberTypes_Count);
+      if (!compileExpressionOfType(numberType, &tokenizer, &programs[i])) {
+        printf("%s in %s\n", tokenizer.error, formula);
+        numberFailedTests = testSamples;
+        break;
+      }
 
-      r64 correctResult = insertGeneratedExpr(&stringBuilder);
-      stringBuilderPut(&stringBuilder, '\0');
+      branchingCount += (programs[i].branchDepth > 0) ? 1 : 0;
+      localsCount += (programs[i].localCount > 0) ? 1 : 0;
+      inputs[2*i] = getRandPrintFriendlyNumber(-2.0, 2.0);
+      inputs[2*i + 1] = getRandPrintFriendlyNumber(-2.0, 2.0);
+      correctResults[i] = evalProgramOfTypeAt(&programs[i], inputs[2*i], inputs[2*i + 1]);
+    }
+
+    if ((numberFailedTests == 0) && ((branchingCount == 0) || (localsCount == 0))) {
+      puts("Programs of the image have no branches or no locals");
+      numberFailedTests = testSamples;
+    }
+
+    size_t imageSize = getProgramImageSize(programs, testSamples);
+    void *imageMemory = malloc(imageSize);
+    if (writeProgramImage(programs, testSamples, imageMemory, imageSize) != imageSize) {
+      puts("Failed to write program image");
+      numberFailedTests = testSamples;
+    }
+
+    ProgramImage image = {};
+    START_TIMEDBLOCK("OPEN");
+    bool32 isOpen = openProgramImage(&image, imageMemory, imageSize);
+    TimeUnit openClockCycles = GET_TIMEDBLOCK("OPEN");
+
+    if (!isOpen) {
+      puts("Failed to open program image");
+      numberFailedTests = testSamples;
+    }
+    else if (numberFailedTests == 0) {
+      for (int i = 0; i < testSamples; i++) {
+        Program program;
+        if (!getImageProgram(&image, i, &program)) {
+          printf("Program %d is missing or corrupt\n", i);
+          numberFailedTests++;
+          continue;
+        }
+
+        r64 result = evalProgramOfTypeAt(&program, inputs[2*i], inputs[2*i + 1]);
+        // NOTE(Hakan): Compare bit patterns so that NaN results match too
+        if (memcmp(&result, &correctResults[i], sizeof(r64)) != 0) {
+          printf("Program %d = %f != %f\n", i, result, correctResults[i]);
+          numberFailedTests++;
+        }
+      }
+
+      // NOTE(Hakan): The same programs once through a real file
+      const char *imagePath = "calc_test.image";
+      ProgramImage mappedImage = {};
+      if (!writeProgramImageFile(imagePath, programs, testSamples) || !mapProgramImageFile(&mappedImage, imagePath)) {
+        puts("Failed to write and map program image file");
+        numberFailedTests++;
+      }
+      else {
+        for (int i = 0; i < testSamples; i++) {
+          Program program;
+          r64 result = 0;
+          if (getImageProgram(&mappedImage, i, &program)) {
+            result = evalProgramOfTypeAt(&program, inputs[2*i], inputs[2*i + 1]);
+          }
+          if (memcmp(&result, &correctResults[i], sizeof(r64)) != 0) {
+            printf("Mapped program %d = %f != %f\n", i, result, correctResults[i]);
+            numberFailedTests++;
+          }
+        }
+        unmapProgramImageFile(&mappedImage);
+      }
+      remove(imagePath);
 
-      tokenizer.at = stringBuilder.text;
+      // NOTE(Hakan): Programs are verified once per opened image, so the image
+      // is opened again after every change to it. Flipping a byte in a record
+      // must be caught by its checksum.
+      Program program;
+      image.memory[image.entries[0].offset] ^= 0xff;
+      closeProgramImage(&image);
+      openProgramImage(&image, imageMemory, imageSize);
+      if (getImageProgram(&image, 0, &program)) {
+        puts("Corrupt program was not detected");
+        numberFailedTests++;
+      }
 
-      START_TIMEDBLOCK("EVAL");
-      r64 result = evalExpression(&tokenizer);
-      avgClockCycles += GET_TIMEDBLOCK("EVAL");
+      // NOTE(Hakan): A record whose checksums were rewritten after it was
+      // tampered with must still fail verification, here with an operand
+      // out of bounds, with a stack size smaller than the code needs, with a
+      // jump past the instruction it has to land on and with a local slot
+      // the program doesn't have
+      int tamperedIndices[4] = {1, 2, -1, -1};
+      ProgramImageEntry *entry = &image.entries[1];
+      Instruction *code = (Instruction*)(image.memory + entry->offset +
+                                         getNumberTypeSize((NumberType)entry->numberType) * entry->constantCount);
+      code[0].operand = entry->constantCount + entry->variableCount + entry->localCount;
+      image.entries[2].stackSize--;
 
-      if ((result - correctResult) > 0.1) {
-        fputs(stringBuilder.text, stdout);
-        printf(" = %f = %f\n", result, correctResult);
+      for (int i = 3; (i < testSamples) && ((tamperedIndices[2] < 0) || (tamperedIndices[3] < 0)); i++) {
+        Instruction *jump = findImageInstruction(&image, i, Token_IfThen);
+        Instruction *load = findImageInstruction(&image, i, Token_LoadLocal);
+        if ((tamperedIndices[2] < 0) && jump) {
+          jump->operand++;
+          tamperedIndices[2] = i;
+        }
+        else if ((tamperedIndices[3] < 0) && load) {
+          load->operand = image.entries[i].localCount;
+          tamperedIndices[3] = i;
+        }
+      }
+
+      for (int tamperedIndex = 0; tamperedIndex < 4; tamperedIndex++) {
+        int i = tamperedIndices[tamperedIndex];
+        if (i >= 0) {
+          image.entries[i].checksum = checksum32(image.memory + image.entries[i].offset, getProgramRecordSize(&programs[i]));
+        }
+      }
+      image.header->entriesChecksum = checksum32(image.entries, sizeof(ProgramImageEntry) * image.programCount);
+
+      closeProgramImage(&image);
+      if (!openProgramImage(&image, imageMemory, imageSize)) {
+        puts("Failed to reopen program image");
         numberFailedTests++;
       }
+      else {
+        for (int tamperedIndex = 0; tamperedIndex < 4; tamperedIndex++) {
+          int i = tamperedIndices[tamperedIndex];
+          if ((i < 0) || getImageProgram(&image, i, &program)) {
+            printf("Invalid program %d was not detected\n", i);
+            numberFailedTests++;
+          }
+        }
+      }
+    }
+    closeProgramImage(&image);
+
+    for (int i = 0; i < testSamples; i++) {
+      freeProgram(&programs[i]);
     }
+    free(programs);
+    free(inputs);
+    free(correctResults);
+    free(imageMemory);
+    freeFunctionTable(&functions);
 
-    printf("## Average clock pulses %f\n", (r64)avgClockCycles / (r64)testSamples);
+    printf("## Image of %zu bytes opened in %lld clock pulses\n", imageSize, (long long)openClockCycles);
     const int succeddedTests = (testSamples - numberFailedTests);
     printf("## %d/%d(%.1f%%) test succeeded\n\n", succeddedTests, testSamples, 100.0*((r64)succeddedTests/(r64)testSamples));
   }
 #endif
 
+#if TEST_Streaming
+  testStreaming(20);
+#endif
+
+#if TEST_LargeExpression
+  benchmarkLargeExpressions(LARGE_EXPRESSION_MAX_TOKENS);
+#endif
+
 #if TEST_StringToDouble
   {
     const int testSamples = 1000000;
@@ -233,7 +1254,7 @@ int main(int numArguments, char** arguments) {
       token.textLength = strlen(stringBuilder.text);
 
       START_TIMEDBLOCK("my ");
-      r64 result = numberTokenToValue(&token);
+      r64 result = numberTokenToValue<r64>(&token);
       myAvgClockCycles += GET_TIMEDBLOCK("my ");
 
       START_TIMEDBLOCK("std");